@@ -18,39 +18,465 @@
 +======================================================================
 */
 
+
 #include <AudioPlaySdWavPR.h>
+#include <spi_interrupt.h>
+#include "TactileCPU.h"               // tactileLog
+
+volatile uint8_t AudioPlaySdWavPR::_syncMembers = 0;
+volatile uint8_t AudioPlaySdWavPR::_syncWaiting = 0;
+volatile uint8_t AudioPlaySdWavPR::_syncEpoch   = 0;
+volatile uint32_t AudioPlaySdWavPR::_syncRestartAt = 0;
+
+volatile uint32_t AudioPlaySdWavPR::_sampleClock = 0;
+AudioPlaySdWavPR *AudioPlaySdWavPR::_clockOwner  = NULL;
+uint8_t AudioPlaySdWavPR::_numPlayers = 0;
+
+AudioPlayerEvent  AudioPlaySdWavPR::_events[PLAYER_EVENT_QUEUE_SIZE];
+volatile uint8_t  AudioPlaySdWavPR::_eventHead     = 0;
+volatile uint8_t  AudioPlaySdWavPR::_eventTail     = 0;
+volatile uint32_t AudioPlaySdWavPR::_eventsDropped = 0;
+
+/*----------------------------------------------------------------------
+ * Audio interrupt: called by the audio library every audio block
+ * (128 samples, about 2.9 msec).
+ ----------------------------------------------------------------------*/
 
 void AudioPlaySdWavPR::update(void) {
-  if (paused) {
+  if (this == _clockOwner)
+    _sampleClock += AUDIO_BLOCK_SAMPLES;
+  uint32_t blockStart = _sampleClock - AUDIO_BLOCK_SAMPLES;
+  _blockStart = blockStart;
+
+  if (_paused) {
     return;
   }
-  AudioPlaySdWav::update();
+
+  int first = 0;                // first sample of this block that plays
+  switch (_state) {
+  case PLAYER_PLAYING:
+    break;
+  case PLAYER_HELD: {
+    if (!_startScheduled)
+      return;                   // prepared, waiting for start()
+    int32_t offset = (int32_t)(_startAt - blockStart);
+    if (offset >= AUDIO_BLOCK_SAMPLES)
+      return;                   // not yet
+    if (offset > 0)
+      first = offset;           // (if we're late, start right away)
+    _startScheduled = false;
+    _state = PLAYER_PLAYING;
+    _postEvent(PLAYER_EVENT_STARTED);
+    break;
+  }
+  case PLAYER_LOOP_WAIT:
+    if (_loopEpoch == _syncEpoch)
+      return;                   // other players in the group haven't finished yet
+    if ((int32_t)(blockStart - _syncRestartAt) < 0)
+      return;                   // they have, but the group restarts in the next block
+    _rewind();
+    _state = PLAYER_PLAYING;
+    _postEvent(PLAYER_EVENT_LOOPED);
+    break;
+  default:
+    return;                     // stopped, or not ready yet
+  }
+
+  int last = AUDIO_BLOCK_SAMPLES;       // one past the last sample that plays
+  bool stopping = false;
+  if (_stopScheduled) {
+    int32_t offset = (int32_t)(_stopAt - blockStart);
+    if (offset < AUDIO_BLOCK_SAMPLES) {
+      last = (offset > first) ? offset : first;
+      stopping = true;
+    }
+  }
+
+  if (!_transmitBlock(first, last))
+    _underrun();
+  else if (_firstBlock) {
+    _firstBlock = false;
+    _postEvent(PLAYER_EVENT_FIRST_BLOCK);
+  }
+  if (stopping) {
+    _postEvent(PLAYER_EVENT_STOPPED);
+    _leaveSyncGroup();
+    _close();
+    return;
+  }
+
+  // Read ahead, so the next block is ready
+  if (_bufferPos < _bufferFrames || _fillBuffer() > 0)
+    return;
+
+  // Reached the end of the audio data.
+  if (_syncLoop) {
+    _state = PLAYER_LOOP_WAIT;
+    _loopEpoch = _syncEpoch;
+    if (++_syncWaiting >= _syncMembers)         // last one to finish restarts the group
+      _restartSyncGroup();
+  } else if (_loop) {
+    _rewind();
+    _postEvent(PLAYER_EVENT_LOOPED);
+  } else {
+    _postEvent(PLAYER_EVENT_END);
+    _close();
+  }
 }
 
-void AudioPlaySdWavPR::pause(void) {
-  paused = 1;
+// Reads the next block(s) of audio data into _buffer. Returns the number of
+// sample frames read, which is zero at the end of the data (or on a read
+// error).
+
+uint16_t AudioPlaySdWavPR::_fillBuffer(void) {
+  uint32_t n = _readBlocks * AUDIO_BLOCK_SAMPLES * _info.blockAlign;
+  if (n > _dataRemaining)
+    n = _dataRemaining;
+  int got = 0;
+  if (n > 0) {
+    uint32_t start = micros();
+    got = _file.read(_buffer, n);
+    uint32_t elapsed = micros() - start;
+    int bucket = (elapsed > 0) ? 31 - __builtin_clz(elapsed) : 0;
+    if (bucket >= PLAYER_LATENCY_BUCKETS)
+      bucket = PLAYER_LATENCY_BUCKETS - 1;
+    _stats.readLatency[bucket]++;
+    _stats.reads++;
+    if (elapsed > _stats.maxReadMicros)
+      _stats.maxReadMicros = elapsed;
+    if (elapsed > PLAYER_BLOCK_MICROS)
+      _stats.lateBlocks++;
+  }
+  if (got < (int)n) {
+    _dataRemaining = 0;
+    _underrun();                                // read error; treated as the end of the file
+  } else
+    _dataRemaining -= got;
+  _bufferFrames = (got > 0) ? got / _info.blockAlign : 0;
+  _bufferPos = 0;
+  return _bufferFrames;
 }
 
-void AudioPlaySdWavPR::resume(void) {
-  paused = 0;
+// Sends one audio block: silence before sample "first" and from sample
+// "last" onwards, audio from the file in between. Returns false if there
+// wasn't any audio memory, in which case the block is lost.
+
+bool AudioPlaySdWavPR::_transmitBlock(int first, int last) {
+  audio_block_t *left = allocate();
+  if (!left)
+    return false;
+  audio_block_t *right = NULL;
+  if (_info.channels == 2) {
+    right = allocate();
+    if (!right) {
+      release(left);
+      return false;
+    }
+  }
+
+  int i;
+  for (i = 0; i < first; i++) {
+    left->data[i] = 0;
+    if (right)
+      right->data[i] = 0;
+  }
+  while (i < last) {
+    if (_bufferPos >= _bufferFrames && _fillBuffer() == 0)
+      break;
+    int n = _bufferFrames - _bufferPos;
+    if (n > last - i)
+      n = last - i;
+    if (right) {
+      const int16_t *src = _buffer + 2*_bufferPos;
+      for (int j = 0; j < n; j++) {
+        left->data[i+j]  = src[2*j];
+        right->data[i+j] = src[2*j+1];
+      }
+    } else {
+      memcpy(left->data + i, _buffer + _bufferPos, n * sizeof(int16_t));
+    }
+
+    // Fade in, if we skipped leading silence
+    for (int j = 0; j < n && _rampPos < PLAYER_RAMP_FRAMES; j++, _rampPos++) {
+      left->data[i+j] = (int32_t)left->data[i+j] * _rampPos / PLAYER_RAMP_FRAMES;
+      if (right)
+        right->data[i+j] = (int32_t)right->data[i+j] * _rampPos / PLAYER_RAMP_FRAMES;
+    }
+
+    i += n;
+    _bufferPos += n;
+  }
+  for (; i < AUDIO_BLOCK_SAMPLES; i++) {
+    left->data[i] = 0;
+    if (right)
+      right->data[i] = 0;
+  }
+
+  transmit(left, 0);
+  transmit(right ? right : left, 1);    // mono files play on both channels
+  release(left);
+  if (right)
+    release(right);
+  return true;
 }
 
-void AudioPlaySdWavPR::play(const char *filename) {
-  if (!filename) {
-    Serial.println("AudioPlaySdWavPR: ERROR: null filename");
+/*----------------------------------------------------------------------
+ * Event queue. Single producer (the audio interrupt, or stop() and
+ * serviceIO() with the audio interrupt disabled), single consumer (the
+ * main loop).
+ ----------------------------------------------------------------------*/
+
+void AudioPlaySdWavPR::_postEvent(uint8_t type) {
+  uint8_t head = _eventHead;
+  uint8_t next = (head + 1) & (PLAYER_EVENT_QUEUE_SIZE - 1);
+  if (next == _eventTail) {
+    _eventsDropped++;
     return;
   }
-  paused = 0;
-  AudioPlaySdWav::play(filename);
+  AudioPlayerEvent *e = &_events[head];
+  e->player     = _playerId;
+  e->type       = type;
+  e->playId     = _playId;
+  e->sampleTime = _blockStart;
+  __sync_synchronize();                 // event is written before it's published
+  _eventHead = next;
+}
+
+bool AudioPlaySdWavPR::getEvent(AudioPlayerEvent *event) {
+  uint8_t tail = _eventTail;
+  if (tail == _eventHead)
+    return false;
+  __sync_synchronize();
+  *event = _events[tail];
+  _eventTail = (tail + 1) & (PLAYER_EVENT_QUEUE_SIZE - 1);
+  return true;
+}
+
+void AudioPlaySdWavPR::_underrun(void) {
+  _stats.underruns++;
+  _postEvent(PLAYER_EVENT_UNDERRUN);
+}
+
+/*----------------------------------------------------------------------
+ * Statistics. The audio interrupt updates them, so they're copied and
+ * cleared with it disabled.
+ ----------------------------------------------------------------------*/
+
+void AudioPlaySdWavPR::getStats(AudioPlayerStats *stats) {
+  AudioNoInterrupts();
+  *stats = _stats;
+  AudioInterrupts();
+}
+
+void AudioPlaySdWavPR::resetStats(void) {
+  AudioNoInterrupts();
+  memset(&_stats, 0, sizeof(_stats));
+  AudioInterrupts();
+}
+
+void AudioPlaySdWavPR::_rewind(void) {
+  _file.seek(_info.dataOffset);
+  _dataRemaining = _info.dataLength;
+  _rampPos = PLAYER_RAMP_FRAMES;        // loops play the whole file
+  _fillBuffer();
+}
+
+// Takes this player out of the sync-loop group. If all the others were
+// waiting for it to finish, they restart. (Called from the audio
+// interrupt, or with it disabled.)
+
+void AudioPlaySdWavPR::_leaveSyncGroup(void) {
+  if (!_syncLoop)
+    return;
+  if (_state == PLAYER_LOOP_WAIT && _syncWaiting > 0)
+    _syncWaiting--;
+  _syncMembers--;
+  if (_syncMembers > 0 && _syncWaiting >= _syncMembers)
+    _restartSyncGroup();
+  _syncLoop = false;
+}
+
+// Restarts the waiting players at the start of the next audio block.
+// Players are updated one after another, so if each restarted as soon
+// as it saw the new epoch, the ones updated before the last player
+// finished would restart a block later than the rest.
+
+void AudioPlaySdWavPR::_restartSyncGroup(void) {
+  _syncWaiting = 0;
+  _syncRestartAt = _sampleClock;        // the start of the next block
+  _syncEpoch++;
+}
+
+void AudioPlaySdWavPR::_close(void) {
+  _state = PLAYER_STOPPED;
+  _startScheduled = false;
+  _stopScheduled = false;
+  if (_file)
+    _file.close();
+  if (_usingSPI) {
+    AudioStopUsingSPI();
+    _usingSPI = false;
+  }
+}
+
+/*----------------------------------------------------------------------
+ * Control, called from the main loop.
+ ----------------------------------------------------------------------*/
+
+bool AudioPlaySdWavPR::prepare(const char *filename, bool syncLoop, uint32_t skipBytes, FS *fs,
+                               const TactileWavInfo *info) {
+  if (!queuePrepare(filename, syncLoop, skipBytes, fs, info))
+    return false;
+  while (serviceIO())
+    ;
+  return _state == PLAYER_HELD;
+}
+
+bool AudioPlaySdWavPR::queuePrepare(const char *filename, bool syncLoop, uint32_t skipBytes, FS *fs,
+                                    const TactileWavInfo *info) {
+  if (!filename) {
+    tactileLog.println("AudioPlaySdWavPR: ERROR: null filename");
+    return false;
+  }
+  if (strlen(filename) >= PLAYER_MAX_PATH) {
+    tactileLog.println("AudioPlaySdWavPR: ERROR: filename too long");
+    return false;
+  }
+  stop();
+  strcpy(_pendingName, filename);
+  _pendingSyncLoop = syncLoop;
+  _pendingSkip = skipBytes;
+  _pendingHaveInfo = info && TactileWav::isSupported(info);
+  if (_pendingHaveInfo)
+    _pendingInfo = *info;
+  _fs = fs ? fs : &SD;
+  _playId++;
+  _ioStep = PLAYER_IO_OPEN;
+  _state = PLAYER_PENDING;
+  return true;
+}
+
+// Does the next step of a queued prepare. Files are also read by
+// update(), so the audio interrupt is kept out while we're using them.
+
+bool AudioPlaySdWavPR::serviceIO(void) {
+  if (_state != PLAYER_PENDING)
+    return false;
+
+  bool ok = true;
+  AudioNoInterrupts();
+  switch (_ioStep) {
+
+  case PLAYER_IO_OPEN:
+    if (_fs == &SD) {
+      AudioStartUsingSPI();
+      _usingSPI = true;
+    }
+    _file = _fs->open(_pendingName);
+    ok = _file;
+
+    // A header we were given is used if the file still fits it
+    if (ok && _pendingHaveInfo && _file.size() >= _pendingInfo.dataOffset + _pendingInfo.dataLength) {
+      _info = _pendingInfo;
+      _ioStep = PLAYER_IO_PRIME;
+    } else
+      _ioStep = PLAYER_IO_HEADER;
+    break;
+
+  case PLAYER_IO_HEADER:
+    ok = TactileWav::parseHeader(&_file, &_info) && TactileWav::isSupported(&_info);
+    _ioStep = PLAYER_IO_PRIME;
+    break;
+
+  case PLAYER_IO_PRIME: {
+    uint32_t skipBytes = _pendingSkip - _pendingSkip % _info.blockAlign;
+    if (skipBytes >= _info.dataLength)
+      skipBytes = 0;
+    _file.seek(_info.dataOffset + skipBytes);
+    _dataRemaining = _info.dataLength - skipBytes;
+    _rampPos = (skipBytes > 0) ? 0 : PLAYER_RAMP_FRAMES;
+    _fillBuffer();
+    _firstBlock = true;
+    _paused = 0;
+    _syncLoop = _pendingSyncLoop;
+    if (_syncLoop)
+      _syncMembers++;
+    _state = PLAYER_HELD;
+    break;
+  }
+  }
+  if (!ok) {
+    _blockStart = _sampleClock;
+    _postEvent(PLAYER_EVENT_ERROR);
+    _close();
+  }
+  AudioInterrupts();
+  return true;
+}
+
+void AudioPlaySdWavPR::start(void) {
+  startAt(_sampleClock);                // i.e. the next audio block (or as soon as it's ready)
+}
+
+void AudioPlaySdWavPR::play(const char *filename) {
+  if (prepare(filename))
+    start();
+}
+
+void AudioPlaySdWavPR::startAt(uint32_t sampleTime) {
+  if (_state != PLAYER_HELD && _state != PLAYER_PENDING)
+    return;
+  _startAt = sampleTime;
+  _startScheduled = true;
+}
+
+void AudioPlaySdWavPR::playAt(const char *filename, uint32_t sampleTime) {
+  if (prepare(filename))
+    startAt(sampleTime);
+}
+
+void AudioPlaySdWavPR::stopAt(uint32_t sampleTime) {
+  if (_state == PLAYER_STOPPED)
+    return;
+  _stopAt = sampleTime;
+  _stopScheduled = true;
 }
 
 void AudioPlaySdWavPR::stop(void) {
-  paused = 0;
-  AudioPlaySdWav::stop();
+  AudioNoInterrupts();
+  if (_state != PLAYER_STOPPED) {
+    _blockStart = _sampleClock;
+    _postEvent(PLAYER_EVENT_STOPPED);
+    _leaveSyncGroup();
+    _close();
+  }
+  _syncLoop = false;
+  _paused = 0;
+  AudioInterrupts();
+}
+
+bool AudioPlaySdWavPR::isPlaying(void) {
+  return _state != PLAYER_STOPPED;
+}
+
+void AudioPlaySdWavPR::pause(void) {
+  _paused = 1;
+}
+
+void AudioPlaySdWavPR::resume(void) {
+  _paused = 0;
+}
+
+void AudioPlaySdWavPR::setReadBlocks(uint8_t blocks) {
+  if (blocks < 1)
+    blocks = 1;
+  else if (blocks > PLAYER_MAX_READ_BLOCKS)
+    blocks = PLAYER_MAX_READ_BLOCKS;
+  _readBlocks = blocks;                 // takes effect at the next read
 }
 
 unsigned char AudioPlaySdWavPR::isPaused(void) {
-  if (paused && !isPlaying())  // happens if the track reaches the end
-    paused = 0;
-  return paused;
+  if (_paused && !isPlaying())  // happens if the track reaches the end
+    _paused = 0;
+  return _paused;
 }
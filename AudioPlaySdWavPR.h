@@ -18,15 +18,63 @@
 +======================================================================
 */
 
+
 /*----------------------------------------------------------------------
- * This class extends the Audio.h library from PJRC for the Teensy 4
- * audio shield, adding a pause/resume feature.
+ * A .WAV file player for the Teensy 4 audio shield. This started as an
+ * extension of the AudioPlaySdWav player in PJRC's Audio.h library,
+ * adding a pause/resume feature; it now does its own file streaming so
+ * that it can also:
+ *
+ *   - prepare() a track: open the file, read the header and the first
+ *     block of audio, but stay silent until start() is called. Starting
+ *     several prepared players with audio interrupts disabled starts
+ *     them all in the same audio block.
+ *
+ *   - prepare without blocking: queuePrepare() only records the request;
+ *   the SD card work (open, read the header, read the first block) is
+ *   done one step per call to serviceIO(), from the main loop, so the
+ *   caller never waits for more than one SD operation at a time. A
+ *   track started while it's being prepared starts as soon as it's
+ *   ready.
+ *
+ *   - start and stop at an exact sample time. All players share a
+ *   sample clock (samples since the audio system started), and a
+ *   scheduled start or stop takes effect at that sample, even in the
+ *   middle of an audio block.
+ *
+ *   - loop in sync with other players: players prepared with syncLoop
+ *     form a group. When one reaches the end of its file it waits
+ *     (silently) until every player in the group has reached the end,
+ *     then they all restart together at the start of the next audio
+ *     block. Stems of identical length therefore loop seamlessly and
+ *     never drift.
+ *
+ *   - skip leading silence: prepare() can start part way into the
+ *   audio data (see TactileFileManager's leading-silence index), with
+ *   a short fade-in so the new start doesn't click.
+ *
+ *   - report what happened: update() posts lifecycle events (started,
+ *   first block output, end reached, looped, underrun, stopped) to a
+ *   lock-free queue that the main loop drains with getEvent(). The
+ *   audio interrupt is the only writer except for stop() and
+ *   serviceIO(), which post with the audio interrupt disabled.
+ *
+ *   - measure the file system: every read is timed into a log-scale
+ *   histogram, and underruns and late blocks (a read that took longer
+ *   than an audio block lasts) are counted. See getStats().
+ *
+ * Files can come from any file system (FS), not just the SD card, e.g.
+ * a LittleFS in flash memory (see TactileFileManager's flash tier).
+ *
+ * Like the PJRC player, the file is read inside update(), normally one
+ * audio block at a time (see setReadBlocks() for slow cards). The block
+ * that will be played next is always read ahead, so the first block
+ * after start() comes straight from memory.
+ *
+ * Only 16-bit PCM files (mono or stereo, 44.1 kHz) are supported.
  *
- * Note: it's not clear if this is the right way to do this. While paused,
- * this simply doesn't get any more data from the SD file and forward it
- * to the audio player. It might be that a more correct way is to
- * fill the buffer with zero bytes or something like that. But this
- * seems to work, so...
+ * Note: while paused, this simply doesn't transmit any audio blocks,
+ * which the mixer treats as silence.
  *
  * See: https://www.pjrc.com/teensy/td_libs_Audio.html
  ----------------------------------------------------------------------*/
@@ -35,28 +83,189 @@
 #define _AUDIO_PLAY_SD_WAV_PR_H_ 1
 
 #include <Audio.h>
+#include <SD.h>
 
-class AudioPlaySdWavPR : public AudioPlaySdWav {
+#include "TactileWav.h"
+
+// Player events
+#define PLAYER_EVENT_STARTED     1      // a prepared track started
+#define PLAYER_EVENT_FIRST_BLOCK 2      // first audio block sent to the mixer
+#define PLAYER_EVENT_END         3      // reached the end of the file and stopped
+#define PLAYER_EVENT_LOOPED      4      // reached the end of the file and restarted
+#define PLAYER_EVENT_UNDERRUN    5      // no audio memory, or the file couldn't be read
+#define PLAYER_EVENT_STOPPED     6      // stopped by stop() or stopAt()
+#define PLAYER_EVENT_ERROR       7      // a queued prepare failed: no such file, or one it can't play
+
+#define PLAYER_EVENT_QUEUE_SIZE 32      // must be a power of 2
+
+#define PLAYER_RAMP_FRAMES 128          // fade-in after skipping leading silence
+
+#define PLAYER_MAX_PATH 320             // longest file path for queuePrepare(), plus 1
+
+#define PLAYER_MAX_READ_BLOCKS 4        // most audio blocks read at once (see setReadBlocks())
+
+// Read latency histogram: bucket n counts reads that took 2^n to
+// 2^(n+1)-1 microseconds (bucket 0 includes 0), the last bucket
+// everything longer.
+#define PLAYER_LATENCY_BUCKETS 16
+#define PLAYER_BLOCK_MICROS ((uint32_t)(AUDIO_BLOCK_SAMPLES * 1000000.0 / AUDIO_SAMPLE_RATE_EXACT))
+
+struct AudioPlayerEvent {
+  uint8_t  player;                      // see playerId()
+  uint8_t  type;
+  uint16_t playId;                      // see playId()
+  uint32_t sampleTime;                  // start of the audio block it happened in
+};
+
+struct AudioPlayerStats {
+  uint32_t readLatency[PLAYER_LATENCY_BUCKETS];
+  uint32_t reads;
+  uint32_t maxReadMicros;
+  uint32_t underruns;                   // blocks lost: no audio memory, or a read error
+  uint32_t lateBlocks;                  // reads that took longer than PLAYER_BLOCK_MICROS
+};
+
+class AudioPlaySdWavPR : public AudioStream {
 
 public:
   
   // Constructor.
-  AudioPlaySdWavPR() {
-    paused = 0;
+  AudioPlaySdWavPR() : AudioStream(0, NULL) {
+    _state = PLAYER_STOPPED;
+    _paused = 0;
+    _syncLoop = false;
+    _startScheduled = false;
+    _stopScheduled = false;
+    _bufferFrames = 0;
+    _bufferPos = 0;
+    _readBlocks = 1;
+    _usingSPI = false;
+    _fs = &SD;
+    _pendingHaveInfo = false;
+    _loop = false;
+    _playId = 0;
+    _playerId = _numPlayers++;
+    memset(&_stats, 0, sizeof(_stats));
+    if (!_clockOwner)
+      _clockOwner = this;
   }
 
-  // override base-class methods
-  void update(void);
+  virtual void update(void);
+
   void play(const char *filename);
   void stop(void);
-  
-  // New methods
+  bool isPlaying(void);
+
   void pause(void);
   void resume(void);
   unsigned char isPaused(void);
 
+  // Open and prime a track without starting it. info: the file's header,
+  // if it's already known (e.g. from TactileFileManager's catalog), so it
+  // isn't read again.
+  bool prepare(const char *filename, bool syncLoop = false, uint32_t skipBytes = 0, FS *fs = &SD,
+               const TactileWavInfo *info = NULL);
+  void start(void);
+
+  // The same, without blocking: call serviceIO() until it returns false.
+  bool queuePrepare(const char *filename, bool syncLoop = false, uint32_t skipBytes = 0, FS *fs = &SD,
+                    const TactileWavInfo *info = NULL);
+  bool serviceIO(void);                 // true if it did some work
+
+  // Scheduled start/stop, at a sample time (see sampleTime()).
+  void playAt(const char *filename, uint32_t sampleTime);
+  void startAt(uint32_t sampleTime);
+  void stopAt(uint32_t sampleTime);
+
+  // The file system of the track being played (NULL if stopped)
+  FS  *fileSystem(void) { return (_state == PLAYER_STOPPED) ? NULL : _fs; }
+
+  // Loop this player on its own (not synchronized)
+  void setLoop(bool on) { _loop = on; }
+
+  // Audio blocks read from the file at a time (1 to PLAYER_MAX_READ_BLOCKS).
+  // Bigger reads are fewer, which suits cards that are slow to start a read.
+  void setReadBlocks(uint8_t blocks);
+
+  // Events. playerId() identifies this player; playId() changes every
+  // time a track is prepared, so stale events can be recognized.
+  static bool getEvent(AudioPlayerEvent *event);
+  static uint32_t getEventsDropped(void) { return _eventsDropped; }
+  uint8_t  playerId(void) { return _playerId; }
+  uint16_t playId(void) { return _playId; }
+
+  // The shared sample clock: the time of the first sample of the next
+  // audio block to be played. Wraps after about 27 hours.
+  static uint32_t sampleTime(void) { return _sampleClock; }
+
+  // Read latency and underrun statistics, since the last reset
+  void getStats(AudioPlayerStats *stats);
+  void resetStats(void);
+
  private:
-  unsigned char paused;
+  enum { PLAYER_STOPPED, PLAYER_PENDING, PLAYER_HELD, PLAYER_PLAYING, PLAYER_LOOP_WAIT };
+  enum { PLAYER_IO_OPEN, PLAYER_IO_HEADER, PLAYER_IO_PRIME };
+
+  File             _file;
+  TactileWavInfo   _info;
+  uint32_t         _dataRemaining;       // bytes of audio data not yet read from the file
+  int16_t          _buffer[AUDIO_BLOCK_SAMPLES * 2 * PLAYER_MAX_READ_BLOCKS];  // read-ahead audio (interleaved if stereo)
+  uint16_t         _bufferFrames;        // sample frames in _buffer
+  uint16_t         _bufferPos;           // frames of _buffer already played
+  uint8_t          _readBlocks;          // audio blocks per read
+  volatile uint8_t _state;
+  volatile uint8_t _paused;
+  volatile bool    _startScheduled;
+  volatile bool    _stopScheduled;
+  uint32_t         _startAt;
+  uint32_t         _stopAt;
+  bool             _loop;
+  uint16_t         _rampPos;             // frames into the fade-in
+  bool             _firstBlock;          // next block transmitted is the first
+  uint16_t         _playId;
+  uint8_t          _playerId;
+  uint32_t         _blockStart;          // sample time of the block being updated
+  bool             _usingSPI;
+  FS              *_fs;
+  AudioPlayerStats _stats;
+
+  // Pending queuePrepare() request
+  char             _pendingName[PLAYER_MAX_PATH];
+  bool             _pendingSyncLoop;
+  uint32_t         _pendingSkip;
+  TactileWavInfo   _pendingInfo;
+  bool             _pendingHaveInfo;
+  uint8_t          _ioStep;
+  bool             _syncLoop;
+  uint8_t          _loopEpoch;
+
+  // The sync-loop group (there's only one)
+  static volatile uint8_t _syncMembers;
+  static volatile uint8_t _syncWaiting;
+  static volatile uint8_t _syncEpoch;
+  static volatile uint32_t _syncRestartAt;   // sample time the group restarts at
+
+  // The sample clock is advanced by the first player created, which is
+  // also the first one updated in each audio block.
+  static volatile uint32_t _sampleClock;
+  static AudioPlaySdWavPR *_clockOwner;
+  static uint8_t _numPlayers;
+
+  // The event queue
+  static AudioPlayerEvent  _events[PLAYER_EVENT_QUEUE_SIZE];
+  static volatile uint8_t  _eventHead;   // written only by the producer
+  static volatile uint8_t  _eventTail;   // written only by the consumer
+  static volatile uint32_t _eventsDropped;
+
+  void     _postEvent(uint8_t type);
+  void     _underrun(void);
+
+  uint16_t _fillBuffer(void);
+  bool     _transmitBlock(int first, int last);
+  void     _rewind(void);
+  void     _leaveSyncGroup(void);
+  static void _restartSyncGroup(void);
+  void     _close(void);
 };
 
 #endif // _AUDIO_PLAY_SD_WAV_PR_H_
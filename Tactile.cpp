@@ -36,7 +36,9 @@
 +======================================================================*/
 
 #include <Arduino.h>
+#include <malloc.h>
 #include "Tactile.h"
+#include "TactileProfiler.h"
 
 void Tactile::setLogLevel(int level) {
   _tc->setLogLevel(level);
@@ -46,6 +48,91 @@ const char *Tactile::getTrackName(int trackNum) {
   return _ta->getTrackName(trackNum);
 }
 
+uint32_t Tactile::getTrackDuration(int trackNum) {
+  return _ta->getTrackDuration(trackNum);
+}
+
+void Tactile::getAudioStats(TactileAudioStats *stats) {
+  _ta->getAudioStats(stats);
+}
+
+void Tactile::resetAudioStats() {
+  _ta->resetAudioStats();
+}
+
+void Tactile::setAudioStatsInterval(int milliseconds) {
+  _ta->setAudioStatsInterval(milliseconds);
+}
+
+void Tactile::getPlayerStats(int trackNum, AudioPlayerStats *stats) {
+  _ta->getPlayerStats(trackNum - 1, stats);
+}
+
+void Tactile::printPlayerStats() {
+  _ta->printPlayerStats();
+}
+
+int Tactile::testSDCard() {
+  int voices = _ta->testSDCard();
+  if (voices > 0 && voices < NUM_TRACKS && _multiTrack)
+    _tc->logAction("WARNING: the SD card is too slow for multi-track mode; tracks playing at once: ", voices);
+  return voices;
+}
+
+void Tactile::printProfile() {
+#if TACTILE_PROFILE
+  tactileProfiler.print();
+#else
+  tactileLog.println("Profiling is off (see TACTILE_PROFILE in TactileProfiler.h)");
+#endif
+}
+
+void Tactile::resetProfile() {
+#if TACTILE_PROFILE
+  tactileProfiler.reset();
+#endif
+}
+
+void Tactile::getMemoryBudget(TactileMemoryBudget *budget) {
+  budget->engine        = TACTILE_ENGINE_BYTES;
+  budget->sensors       = sizeof(TactileSensors);
+  budget->players       = AUDIO_PLAYER_BYTES;
+  budget->audioPool     = AUDIO_POOL_BYTES;
+  budget->audioPoolUsed = _ta->getAudioPoolBytesUsed();
+  budget->catalog       = _fm->getCatalogBytes();
+  budget->playlists     = _ta->getPlaylistBytes();
+  budget->heapUsed      = mallinfo().uordblks;
+}
+
+void Tactile::printMemoryBudget() {
+  TactileMemoryBudget b;
+  getMemoryBudget(&b);
+  tactileLog.print("Memory: static ");
+  tactileLog.print(TACTILE_STATIC_BYTES);
+  tactileLog.print(" (engine ");
+  tactileLog.print(b.engine);
+  tactileLog.print(", sensors ");
+  tactileLog.print(b.sensors);
+  tactileLog.print(", players ");
+  tactileLog.print(b.players);
+  tactileLog.print(", audio pool ");
+  tactileLog.print(b.audioPool);
+  tactileLog.print(", ");
+  tactileLog.print(b.audioPoolUsed);
+  tactileLog.println(" used)");
+  tactileLog.print("        heap ");
+  tactileLog.print(b.heapUsed);
+  tactileLog.print(" (catalog ");
+  tactileLog.print(b.catalog);
+  tactileLog.print(", playlists ");
+  tactileLog.print(b.playlists);
+  tactileLog.println(")");
+}
+
+void Tactile::setVoiceStealing(boolean on) {
+  _ta->setVoiceStealing(on);
+}
+
 void Tactile::setVolume(int percent) {
   _ta->setVolume(percent);
 }
@@ -82,6 +169,9 @@ void Tactile::setTouchToStop(boolean on) {
 
 void Tactile::setMultiTrackMode(boolean on) {
   _multiTrack = on;
+  if (on && _ta->getMaxVoices() < NUM_TRACKS)
+    _tc->logAction("WARNING: the SD card is too slow for multi-track mode; tracks playing at once: ",
+                   _ta->getMaxVoices());
 }
 
 void Tactile::setContinueTrackMode(boolean on) {
@@ -96,12 +186,48 @@ void Tactile::setInactivityTimeout(int seconds) {
   if (seconds < 0)
     seconds = 0;
   _restartTimeout = (uint32_t)(seconds * 1000);
+  if (_restartTimeout == 0)
+    _timers.cancel(TIMER_INACTIVITY);
+  else
+    _noteActivity();
 }
 
 void Tactile::setPlayRandomTrackMode(boolean on) {
   _ta->setPlayRandomTrackMode(on);
 }
 
+bool Tactile::setTrackDirectory(int trackNum, const char *path) {
+  return _ta->setTrackDirectory(trackNum - 1, path);
+}
+
+void Tactile::setPlaylistMode(int mode) {
+  _ta->setPlaylistMode(mode);
+}
+
+bool Tactile::setRandomTrackWeight(int trackNum, const char *fileName, int weight) {
+  return _ta->setRandomTrackWeight(trackNum - 1, fileName, weight);
+}
+
+void Tactile::setPlaylistSaving(boolean on) {
+  _ta->setPlaylistSaving(on);
+}
+
+void Tactile::setStemMode(boolean on) {
+  _ta->setStemMode(on);
+}
+
+void Tactile::setSkipLeadingSilence(boolean on) {
+  _ta->setSkipLeadingSilence(on);
+}
+
+void Tactile::setNormalizeMode(boolean on) {
+  _ta->setNormalizeMode(on);
+}
+
+void Tactile::setFlashTierMode(boolean on) {
+  _ta->setFlashTierMode(on);
+}
+
 void Tactile::setProximityMultiplier(int externSensorNumber, float m) {
   int sensorNumber = externSensorNumber - 1;
   _ts->setProximityMultiplier(sensorNumber, m);
@@ -111,6 +237,54 @@ void Tactile::setAveragingStrength(int samples) {
   _ts->setAveragingStrength(samples);
 }
 
+void Tactile::setSleepBetweenTicks(boolean on) {
+  _sleepBetweenTicks = on;
+}
+
+void Tactile::setIdleTimeout(int seconds) {
+  if (seconds < 0)
+    seconds = 0;
+  _idleTimeout = (uint32_t)(seconds * 1000);
+  if (_idleTimeout == 0) {
+    _timers.cancel(TIMER_IDLE);
+    if (_idle)
+      _wake();
+  } else
+    _noteActivity();
+}
+
+bool Tactile::isIdle() {
+  return _idle;
+}
+
+uint32_t Tactile::getWakeLatency() {
+  return _wakeLatency;
+}
+
+float Tactile::getIdleCurrentEstimate() {
+  if (_idle)
+    return _measureIdleCurrent();
+  return _idleCurrent;
+}
+
+void Tactile::setQuantizeGrid(int milliseconds) {
+  _ta->setQuantizeGrid(milliseconds);
+}
+
+uint32_t Tactile::getSampleTime() {
+  return _ta->getSampleTime();
+}
+
+void Tactile::scheduleTrackStart(int externTrackNumber, uint32_t sampleTime) {
+  if (_idle)
+    _wake();                    // (the outputs are muted while idle)
+  _ta->scheduleStart(externTrackNumber - 1, sampleTime);
+}
+
+void Tactile::scheduleTrackStop(int externTrackNumber, uint32_t sampleTime) {
+  _ta->scheduleStop(externTrackNumber - 1, sampleTime);
+}
+
 void Tactile::setProximityAsVolumeMode(boolean on) {
   _useProximityAsVolume = on;
   if (on) {
@@ -121,7 +295,7 @@ void Tactile::setProximityAsVolumeMode(boolean on) {
 
 void Tactile::setFadeInTime(int milliseconds) {
   if (milliseconds > 0 && _useProximityAsVolume) {
-    Serial.println("WARNING: proximity-as-volume mode is incompatible with fade-in/fade-out. "
+    tactileLog.println("WARNING: proximity-as-volume mode is incompatible with fade-in/fade-out. "
                    "Fade-in time ignored.");
     return;
   }
@@ -132,7 +306,7 @@ void Tactile::setFadeInTime(int milliseconds) {
 
 void Tactile::setFadeOutTime(int milliseconds) {
   if (milliseconds > 0 && _useProximityAsVolume) {
-    Serial.println("WARNING: proximity-as-volume mode is incompatible with fade-in/fade-out. "
+    tactileLog.println("WARNING: proximity-as-volume mode is incompatible with fade-in/fade-out. "
                    "Fade-out time ignored.");
     return;
   }
@@ -143,13 +317,14 @@ void Tactile::setFadeOutTime(int milliseconds) {
 
 Tactile* Tactile::setup() {
 
-  Tactile *t = new(Tactile);
+  Tactile *t = new(tactileStorage<Tactile>()) Tactile;
 
   t->_tc = TactileCPU::setup();
   t->_tc->setLogLevel(1);
 
   t->_ts = TactileSensors::setup(t->_tc);
   t->_ta = TactileAudio::setup(t->_tc);
+  t->_fm = t->_ta->getFileManager();
 
   t->setMultiTrackMode(false);
   t->setContinueTrackMode(false);
@@ -161,15 +336,108 @@ Tactile* Tactile::setup() {
   t->_ledCycle = 0;
   t->_trackCurrentlyPlaying = -1;
   t->_lastActionTime = millis();
+  t->_nextSensorTick = micros();
+  t->_nextAudioTick = t->_nextSensorTick;
+  t->_sleepBetweenTicks = true;
+  t->_idleTimeout = 0;
+  t->_idle = false;
+  t->_sensorTickMicros = SENSOR_TICK_MICROS;
+  t->_idleStartMicros = 0;
+  t->_idleStartSleepMicros = 0;
+  t->_lastIdleScan = 0;
+  t->_wakeLatency = 0;
+  t->_idleCurrent = 0.0;
+
+  tactileLog.setAsync(true);            // from now on, logging never waits for the serial port
   
   return t;
 }
     
+// Restarts the inactivity and idle timeouts
+
+void Tactile::_noteActivity() {
+  _lastActionTime = millis();
+  if (_restartTimeout > 0)
+    _timers.set(TIMER_INACTIVITY, _lastActionTime + _restartTimeout);
+  if (_idleTimeout > 0)
+    _timers.set(TIMER_IDLE, _lastActionTime + _idleTimeout);
+}
+
+/*----------------------------------------------------------------------
+ * Idle. After the idle timeout passes with nothing touched and nothing
+ * playing, the CPU clock is turned down, the codec's outputs are muted,
+ * and the sensors are only read IDLE_SENSOR_TICK_MICROS apart, just to
+ * see if anything is approaching (any sensor past its release threshold).
+ * If so, everything is turned back up and the sensors are read at full
+ * rate again right away, so the touch itself is handled normally.
+ *
+ * The wake latency is measured from the last idle scan that saw nothing,
+ * i.e. it's the longest an approach could have gone unnoticed, plus the
+ * time to turn things back up. The idle current is estimated from the
+ * clock speed and how much of the idle time the CPU spent asleep.
+ ----------------------------------------------------------------------*/
+
+void Tactile::_enterIdle() {
+  // Ask the players, not the track status: in stem mode a track's status
+  // follows its sensor, but all the stems keep streaming underneath.
+  if (!_ta->isAudioIdle()) {
+    _timers.set(TIMER_IDLE, millis() + _idleTimeout);    // e.g. a long track, or loop mode
+    return;
+  }
+  _tc->log("Idle");
+  _ta->setOutputPower(false);
+  _tc->setClockSpeed(TC_IDLE_CLOCK_HZ);
+  _sensorTickMicros = IDLE_SENSOR_TICK_MICROS;
+  _idle = true;
+  _idleStartMicros = micros();
+  _idleStartSleepMicros = _tc->getSleepMicros();
+  _lastIdleScan = _idleStartMicros;
+}
+
+void Tactile::_idleScan(uint32_t now) {
+  // Raw readings: the smoothing is tuned for 1 kHz, and at this tick rate it
+  // would add about 200 msec to the wake-up, unseen by _wakeLatency.
+  for (int sensorNumber = FIRST_SENSOR; sensorNumber <= LAST_SENSOR; sensorNumber++) {
+    if (_ts->getRawProximityPercent(sensorNumber) >= _releaseThreshold[sensorNumber]) {
+      _wake();
+      return;
+    }
+  }
+  _lastIdleScan = now;
+  PROFILE_MARK(PROFILE_SENSORS);
+}
+
+void Tactile::_wake() {
+  _idleCurrent = _measureIdleCurrent();
+  _tc->setClockSpeed(TC_FULL_CLOCK_HZ);
+  _ta->setOutputPower(true);
+  _sensorTickMicros = SENSOR_TICK_MICROS;
+  _idle = false;
+  uint32_t now = micros();
+  _nextSensorTick = now;
+  uint32_t latency = now - _lastIdleScan;
+  if (latency > _wakeLatency)
+    _wakeLatency = latency;
+  _noteActivity();
+  _tc->logAction("Awake, latency (microseconds): ", latency);
+}
+
+float Tactile::_measureIdleCurrent() {
+  uint32_t elapsed = micros() - _idleStartMicros;
+  uint32_t slept = _tc->getSleepMicros() - _idleStartSleepMicros;
+  float current = _tc->estimateCurrent(elapsed > 0 ? 1.0 - (float)slept / (float)elapsed : 1.0);
+  if (_ta->getOutputPower())
+    current += AUDIO_OUTPUT_MA;
+  return current;
+}
+
+template <bool MultiTrack, bool ContinueTrack>
 void Tactile::_touchLoop() {
   int sensorStatus[NUM_SENSORS];
   int sensorChanged[NUM_SENSORS];
 
   int numChanged = _ts->getTouchStatus(sensorStatus, sensorChanged);
+  PROFILE_MARK(PROFILE_SENSORS);
 
   int numTouched = 0;
   for (int sensorNumber = FIRST_SENSOR; sensorNumber <= LAST_SENSOR; sensorNumber++) {
@@ -177,7 +445,7 @@ void Tactile::_touchLoop() {
       numTouched++;
   }
   if (numTouched > 0 || numChanged > 0)
-    _lastActionTime = millis();
+    _noteActivity();
 
   if (numTouched > 0)
     _tc->turnLedOn();
@@ -191,17 +459,19 @@ void Tactile::_touchLoop() {
   // track; if it's released, stop playing. Multiple tracks can go at
   // the same time.
 
-  if (_multiTrack) {
+  const TactileTrackStatus *status = _ta->getTrackStatus();
+
+  if (MultiTrack) {
     for (int sensorNumber = FIRST_SENSOR; sensorNumber <= LAST_SENSOR; sensorNumber++) {
-      int isPlaying = _ta->isPlaying(sensorNumber);
+      int isPlaying = status[sensorNumber].playing;
       if (sensorChanged[sensorNumber] == NEW_TOUCH) {
         if (!isPlaying) {
-          if (!_continueTrack)
+          if (!ContinueTrack)
             _ta->cancelFades(sensorNumber);
           _ta->startTrack(sensorNumber);
           _tc->logAction("start track ", sensorNumber+1);
         } else {
-          if (_ta->isPaused(sensorNumber)) {
+          if (status[sensorNumber].paused) {
             _ta->resumeTrack(sensorNumber);
             _tc->logAction("resume track ", sensorNumber+1);
           } else {
@@ -212,7 +482,7 @@ void Tactile::_touchLoop() {
       }
       else if (sensorChanged[sensorNumber] == NEW_RELEASE) {
         if (isPlaying) {
-          if (_continueTrack) {
+          if (ContinueTrack) {
             _ta->pauseTrack(sensorNumber);
             _tc->logAction("pause track ", sensorNumber+1);
           } else {
@@ -246,7 +516,7 @@ void Tactile::_touchLoop() {
     // If there's a release event, stop or pause that track.
     if (_trackCurrentlyPlaying >= 0
         && sensorChanged[_trackCurrentlyPlaying] == NEW_RELEASE) {
-      if (_continueTrack) {
+      if (ContinueTrack) {
         _ta->pauseTrack(_trackCurrentlyPlaying);
         _tc->logAction("pause track ", _trackCurrentlyPlaying+1);
       } else {
@@ -266,11 +536,11 @@ void Tactile::_touchLoop() {
         break;
       }
       if (sensorStatus[sensorNumber] == IS_TOUCHED) {
-        if (_ta->isPaused(sensorNumber)) {
+        if (status[sensorNumber].paused) {
           _ta->resumeTrack(sensorNumber);
           _tc->logAction("resume track ", sensorNumber+1);
         } else {
-          if (!_continueTrack)
+          if (!ContinueTrack)
             _ta->cancelFades(sensorNumber);
           _ta->startTrack(sensorNumber);
           _tc->logAction("start track ", sensorNumber+1);
@@ -282,6 +552,7 @@ void Tactile::_touchLoop() {
   }
 }
     
+template <bool MultiTrack, bool ContinueTrack>
 void Tactile::_proximityLoop() {
   float sensorValues[NUM_SENSORS];
   float maxSensorValue = 0.0;
@@ -294,6 +565,7 @@ void Tactile::_proximityLoop() {
       maxSensorNumber = sensorNumber;
     }
   }
+  PROFILE_MARK(PROFILE_SENSORS);
 
   // Set the LED brightness proportional to whichever sensor has the highest value
   int led_percent = int(maxSensorValue);
@@ -315,13 +587,14 @@ void Tactile::_proximityLoop() {
     /* Serial.println(); */
   }
 
+  const TactileTrackStatus *status = _ta->getTrackStatus();
   for (int sensorNumber = FIRST_SENSOR; sensorNumber <= LAST_SENSOR; sensorNumber++) {
-    if (_multiTrack || sensorNumber == maxSensorNumber) {
+    if (MultiTrack || sensorNumber == maxSensorNumber) {
       float sensorValue = sensorValues[sensorNumber];
-      int playing = _ta->isPlaying(sensorNumber) && !_ta->isPaused(sensorNumber);
+      int playing = status[sensorNumber].playing && !status[sensorNumber].paused;
       if (sensorValue > _touchThreshold[sensorNumber]) {
         if (!playing) {
-          if (_ta->isPaused(sensorNumber)) {
+          if (status[sensorNumber].paused) {
             _ta->resumeTrack(sensorNumber);
             _tc->logAction("resume ", sensorNumber+1);
           } else {
@@ -330,10 +603,10 @@ void Tactile::_proximityLoop() {
           }
         }
         _ta->setVolume(sensorNumber, sensorValue);
-        _lastActionTime = millis();
+        _noteActivity();
       } else if (sensorValue < _releaseThreshold[sensorNumber]) {
         if (playing) {
-          if (_continueTrack) {
+          if (ContinueTrack) {
             _ta->pauseTrack(sensorNumber);
             _tc->logAction("pause ", sensorNumber+1);
           } else {
@@ -341,32 +614,106 @@ void Tactile::_proximityLoop() {
             _tc->logAction("stop ", sensorNumber+1);
           }
           _ta->setVolume(sensorNumber, 0);
-          _lastActionTime = millis();
+          _noteActivity();
         }
       }
     }
   }
 }
 
-void Tactile::loop() {
+// True if a job that runs every "period" microseconds is due, and if so
+// schedules the next time. The times are kept to a fixed grid, so the
+// rate doesn't drift; if it's fallen a whole period behind (e.g. during a
+// long SD card operation) it skips ahead rather than running repeatedly
+// to catch up.
+
+static bool tickDue(uint32_t *next, uint32_t period, uint32_t now) {
+  if ((int32_t)(now - *next) < 0)
+    return false;
+  *next += period;
+  if ((int32_t)(now - *next) >= 0)
+    *next = now + period;
+  return true;
+}
+
+// Each job runs at its own fixed rate (see the *_TICK_MICROS), so sensor
+// filtering and fades behave the same however busy the CPU is. Between
+// ticks the CPU sleeps until the next interrupt, except while a track is
+// being opened, which is done as fast as possible.
+//
+// There's a version for each combination of modes (see TactileModes.h);
+// the modes are constants inside it, so the tests of them disappear.
+
+template <bool MultiTrack, bool ContinueTrack, bool ProximityAsVolume>
+void Tactile::_loop() {
+  uint32_t now = micros();
+  PROFILE_START();
+
+  // What the tracks are doing, as of this pass
+  _ta->updateTrackStatus();
 
   // Respond to sensor touch/proximity
-  if (_useProximityAsVolume)
-    _proximityLoop();
-  else
-    _touchLoop();
+  if (tickDue(&_nextSensorTick, _sensorTickMicros, now)) {
+    if (_idle)
+      _idleScan(now);
+    else if (ProximityAsVolume)
+      _proximityLoop<MultiTrack, ContinueTrack>();
+    else
+      _touchLoop<MultiTrack, ContinueTrack>();
+    PROFILE_MARK(PROFILE_INTERACTION);
+  } else
+    PROFILE_SKIP();
+
+  // Open files for tracks that were just started (a little at a time)
+  bool busy = _ta->doIOTasks();
+  PROFILE_MARK(PROFILE_IO);
 
   // Do fade-in/out
-  _ta->doTimerTasks();
+  bool audioTick = tickDue(&_nextAudioTick, AUDIO_TICK_MICROS, now);
+  if (audioTick)
+    _ta->doTimerTasks();
   
-  // If the idle-time has expired, reset the continue-track feature to start over
-  uint32_t elapsed = millis() - _lastActionTime;
-  if (elapsed > _restartTimeout) {
-    if (_ta->cancelAll()) {
-      _tc->logAction("Inactivity timeout: ", _restartTimeout);
-      _lastActionTime = millis();
-    }
+  // Timeouts: if the idle-time has expired, reset the continue-track
+  // feature to start over; and go into low-power idle
+  int timer;
+  while ((timer = _timers.due(millis())) >= 0) {
+    if (timer == TIMER_INACTIVITY) {
+      if (_ta->cancelAll())
+        _tc->logAction("Inactivity timeout: ", _restartTimeout);
+    } else if (timer == TIMER_IDLE)
+      _enterIdle();
   }
+  PROFILE_MARK(PROFILE_TIMERS);         // (on every pass, since the deadlines are checked on every pass)
+
+  // Send some of the log, as much as the serial port will take right now
+  tactileLog.drain();
+  PROFILE_MARK(PROFILE_LOGGING);
+
+  if (_sleepBetweenTicks && !busy)
+    _tc->waitForInterrupt();
 }
 
+// Every combination, for loop<Modes>() in sketches
+template void Tactile::_loop<false, false, false>();
+template void Tactile::_loop<true,  false, false>();
+template void Tactile::_loop<false, true,  false>();
+template void Tactile::_loop<true,  true,  false>();
+template void Tactile::_loop<false, false, true>();
+template void Tactile::_loop<true,  false, true>();
+template void Tactile::_loop<false, true,  true>();
+template void Tactile::_loop<true,  true,  true>();
+
+// The modes as they're set now
 
+void Tactile::loop() {
+  switch ((_multiTrack ? 1 : 0) | (_continueTrack ? 2 : 0) | (_useProximityAsVolume ? 4 : 0)) {
+  case 0: _loop<false, false, false>(); break;
+  case 1: _loop<true,  false, false>(); break;
+  case 2: _loop<false, true,  false>(); break;
+  case 3: _loop<true,  true,  false>(); break;
+  case 4: _loop<false, false, true>();  break;
+  case 5: _loop<true,  false, true>();  break;
+  case 6: _loop<false, true,  true>();  break;
+  case 7: _loop<true,  true,  true>();  break;
+  }
+}
@@ -24,16 +24,46 @@
 #include "TactileCPU.h"
 #include "TactileSensors.h"
 #include "TactileAudio.h"
+#include "TactileModes.h"
 
 #define TOUCH_MODE 1
 #define PROXIMITY_MODE 2
 
+// How often loop() does each job, in microseconds
+#define SENSOR_TICK_MICROS        1000                  // read the sensors, 1000 times a second
+#define AUDIO_TICK_MICROS         PLAYER_BLOCK_MICROS   // fades and player events, once per audio block
+#define IDLE_SENSOR_TICK_MICROS   20000                 // while idle (see setIdleTimeout()), 50 times a second
+
+// Tactile's deadlines (see TactileTimers)
+#define TIMER_INACTIVITY          0
+#define TIMER_IDLE                1
+
+// Where the memory goes, in bytes (see getMemoryBudget()). The engine,
+// players and audio pool are static, fixed when compiling; the catalog
+// and playlists are on the heap, and depend on what's on the SD card.
+struct TactileMemoryBudget {
+  uint32_t engine;             // the Tactile objects (static), including...
+  uint32_t sensors;            // ... the sensors' state and filters
+  uint32_t players;            // the players, with their read buffers (static)
+  uint32_t audioPool;          // audio memory blocks (static, DMAMEM), of which...
+  uint32_t audioPoolUsed;      // ... this much is given to the Audio library
+  uint32_t catalog;            // file names, entries and directories (heap)
+  uint32_t playlists;          // random-track weights and alias tables (heap)
+  uint32_t heapUsed;           // everything on the heap, including the above
+};
+
 class Tactile
 {
  public:
   static Tactile *setup();
   void loop(void);
 
+  // Modes fixed at compile time (see TactileModes.h)
+  template <class Modes> void setModes();
+  template <class Modes> void loop() {
+    _loop<Modes::multiTrack, Modes::continueTrack, Modes::proximityAsVolume>();
+  }
+
   void setLogLevel(int level);
 
   void setTouchReleaseThresholds(int touch, int release);
@@ -47,6 +77,14 @@ class Tactile
   void setInactivityTimeout(int seconds);      // continueTrackMode: reset to beginning if idle this long
 
   void setPlayRandomTrackMode(bool on);        // true == random selection from sensor's directory
+  bool setTrackDirectory(int trackNum, const char *path);  // sensor's directory, default E1, E2, ...
+  void setPlaylistMode(int mode);              // random order: PLAYLIST_SHUFFLE (default), _WEIGHTED, _SEQUENTIAL
+  bool setRandomTrackWeight(int trackNum, const char *fileName, int weight);  // 0-255, for PLAYLIST_WEIGHTED
+  void setPlaylistSaving(bool on);             // true == playlists carry on after a restart (uses EEPROM)
+  void setStemMode(bool on);                   // true == all tracks play in sync, sensors control volume
+  void setSkipLeadingSilence(bool on);         // true == tracks start at their first sound
+  void setNormalizeMode(bool on);              // true == every file plays at the same loudness
+  void setFlashTierMode(bool on);              // true == often-played short clips are copied to flash
 
   void setVolume(int percent);
   void setProximityAsVolumeMode(bool on);      // Proximity controls volume, or fixed volume
@@ -54,9 +92,35 @@ class Tactile
   void setFadeInTime(int milliseconds);
   void setFadeOutTime(int milliseconds);
 
-  void setAveragingStrength(int samples);      // more smooths signal, default is 200
+  void setAveragingStrength(int samples);      // more smooths signal, default is 10 (readings at 1 kHz)
+  void setSleepBetweenTicks(bool on);          // true (default) == CPU sleeps when there's nothing to do
+  void setIdleTimeout(int seconds);            // low-power idle after this long with nothing happening, 0 == never
+  bool isIdle();
+  uint32_t getWakeLatency();                   // microseconds, the longest an approach has waited to be noticed
+  float getIdleCurrentEstimate();              // mA, while idle (the current or last idle period)
+
+  void setQuantizeGrid(int milliseconds);      // touches start tracks on a beat grid, 0 == off
+  uint32_t getSampleTime();                    // audio clock, in samples (44100 per second)
+  void scheduleTrackStart(int trackNum, uint32_t sampleTime);
+  void scheduleTrackStop(int trackNum, uint32_t sampleTime);
 
-  const char *getTrackName(int trackNum);
+  void getAudioStats(TactileAudioStats *stats);  // CPU and memory used by audio
+  void resetAudioStats();
+  void setAudioStatsInterval(int milliseconds);   // log audio stats this often, 0 == never
+  void getPlayerStats(int trackNum, AudioPlayerStats *stats);  // SD read latency, underruns
+  void printPlayerStats();                     // read latency histograms, to the serial port
+
+  int  testSDCard();                           // measure the card, limit tracks playing at once to suit
+  void setVoiceStealing(bool on);              // at the limit: true == stop the oldest track, false == ignore touch
+
+  void printProfile();                         // where loop()'s time goes (see TactileProfiler.h)
+  void resetProfile();
+
+  void getMemoryBudget(TactileMemoryBudget *budget);
+  void printMemoryBudget();                    // to the serial port
+
+  const char *getTrackName(int trackNum);      // valid until the next loop(); copy to keep
+  uint32_t    getTrackDuration(int trackNum);  // milliseconds
   
  private:
   TactileCPU     *_tc;
@@ -74,12 +138,42 @@ class Tactile
   int      _ledCycle;
   int      _trackCurrentlyPlaying;
   uint32_t _lastActionTime;
+  uint32_t _nextSensorTick;
+  uint32_t _nextAudioTick;
+  bool     _sleepBetweenTicks;
+  TactileTimers _timers;
+  uint32_t _idleTimeout;
+  bool     _idle;
+  uint32_t _sensorTickMicros;
+  uint32_t _idleStartMicros;
+  uint32_t _idleStartSleepMicros;
+  uint32_t _lastIdleScan;
+  uint32_t _wakeLatency;
+  float    _idleCurrent;
   
-  void _touchLoop();
-  void _proximityLoop();
+  void _noteActivity();
+  void _enterIdle();
+  void _idleScan(uint32_t now);
+  void _wake();
+  float _measureIdleCurrent();
+  template <bool MultiTrack, bool ContinueTrack, bool ProximityAsVolume> void _loop();
+  template <bool MultiTrack, bool ContinueTrack> void _touchLoop();
+  template <bool MultiTrack, bool ContinueTrack> void _proximityLoop();
   void _doVolumeFadeInAndOut();
   void _startTrackIfStartDelayReached();
   void _doTimerTasks();
 };
 
+// The static part of the memory budget, for e.g. a static_assert in a sketch
+#define TACTILE_ENGINE_BYTES  (sizeof(Tactile) + sizeof(TactileCPU) + sizeof(TactileSensors) \
+                               + sizeof(TactileAudio) + sizeof(TactileFileManager))
+#define TACTILE_STATIC_BYTES  (TACTILE_ENGINE_BYTES + AUDIO_PLAYER_BYTES + AUDIO_POOL_BYTES)
+
+template <class Modes> void Tactile::setModes() {
+  setMultiTrackMode(Modes::multiTrack);
+  setContinueTrackMode(Modes::continueTrack);
+  setTouchToStop(Modes::touchToStop);
+  setProximityAsVolumeMode(Modes::proximityAsVolume);
+}
+
 #endif
@@ -25,8 +25,10 @@
 #include <SPI.h>
 #include <SD.h>
 #include <SerialFlash.h>
+#include <EEPROM.h>
 
 #include "TactileAudio.h"
+#include "TactileProfiler.h"
 
 // GUItool: begin automatically generated code
 AudioPlaySdWavPR           playSdWav1;     //xy=124,100
@@ -47,6 +49,9 @@ AudioConnection          patchCord8(playSdWav4, 1, mixer2, 3);
 AudioConnection          patchCord9(mixer1, 0, i2s1, 0);
 AudioConnection          patchCord10(mixer2, 0, i2s1, 1);
 AudioControlSGTL5000     sgtl5000;     //xy=127,379.111083984375
+
+// Audio memory pool; only the first _audioBlocks are used.
+static DMAMEM audio_block_t audioBlocks[AUDIO_BLOCKS_MAX];
 // GUItool: end automatically generated code
 
 TactileAudio::TactileAudio(TactileCPU *tc) {
@@ -55,40 +60,80 @@ TactileAudio::TactileAudio(TactileCPU *tc) {
 
 TactileAudio* TactileAudio::setup(TactileCPU *tc) {
 
-  TactileAudio* t = new TactileAudio(tc);
+  TactileAudio* t = new(tactileStorage<TactileAudio>()) TactileAudio(tc);
   t->_fadeInTime          = 0;
   t->_fadeOutTime         = 0;
+  t->_stemMode            = false;
   t->setVolume(100);
   t->_randomTrackMode     = false;
   t->_loopMode            = false;
+  t->_quantizeSamples     = 0;
+  t->_quantizeOrigin      = 0;
+  t->_skipSilence         = false;
+  t->_normalize           = false;
+  t->_ioNextTrack         = 0;
+  t->_maxVoices           = NUM_TRACKS;
+  t->_voiceStealing       = true;
+  t->_cardPresent         = true;
+  t->_restartStems        = false;
+  t->_stemsStarting       = false;
+  t->_savePlaylists       = false;
+  t->_statsLogInterval    = 0;
+  t->_lastStatsLogTime    = 0;
+  t->_lastStatsCheckTime  = 0;
 
   for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
     t->_targetVolume[trackNumber]          = 100;
     t->_actualVolume[trackNumber]          = 0;
+    t->_normalizeGain[trackNumber]         = 1.0;
     t->_lastStartTime[trackNumber]         = 0;
     t->_lastStopTime[trackNumber]          = 0;
+    t->_startErrors[trackNumber]           = 0;
     t->_thisFadeInTime[trackNumber]        = 0;
     t->_thisFadeOutTime[trackNumber]       = 0;
-    t->_lastRandomTrackPlayed[trackNumber] = -1;
     t->_isPaused[trackNumber]              = false;
+    t->_stemActive[trackNumber]            = false;
+    t->_status[trackNumber].playing        = false;
+    t->_status[trackNumber].paused         = false;
+    t->_status[trackNumber].fading         = false;
+    t->_status[trackNumber].gain           = 0.0;
   }  
 
   // Initialization for the Teensy Audio Shield
 #define SDCARD_CS_PIN    10
 #define SDCARD_MOSI_PIN  7
 #define SDCARD_SCK_PIN   14
-  AudioMemory(2*NUM_TRACKS+4);
+
+  // The file manager starts the SD card, which has the peak audio memory
+  // use from earlier runs.
+  t->_fm = new(tactileStorage<TactileFileManager>()) TactileFileManager(tc);
+
+  // Random-track mode's directories: E1, E2, ... unless set otherwise
+  char dirName[4] = "/Ex";
+  for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
+    dirName[2] = '1' + trackNumber;
+    t->_trackDir[trackNumber] = t->_fm->findDirectory(dirName);
+  }
+
+  t->_savedBlocksPeak = t->_readAudioMemoryPeak();
+  t->_audioBlocks = AUDIO_BLOCKS_PER_VOICE*NUM_TRACKS + AUDIO_BLOCKS_FIXED + AUDIO_BLOCKS_HEADROOM;
+  if (t->_savedBlocksPeak + AUDIO_BLOCKS_HEADROOM > t->_audioBlocks)
+    t->_audioBlocks = t->_savedBlocksPeak + AUDIO_BLOCKS_HEADROOM;
+  if (t->_audioBlocks > AUDIO_BLOCKS_MAX)
+    t->_audioBlocks = AUDIO_BLOCKS_MAX;
+  AudioStream::initialize_memory(audioBlocks, t->_audioBlocks);
+  tc->logAction2("TactileAudio: audio memory blocks: ", t->_audioBlocks);
+
   sgtl5000.enable();
   sgtl5000.volume(0.90);
   delay(1000);  // wait for SGTL5000 to initialize
+  t->_outputOn = true;
 
   for (int i = 0; i < 4; i++) {
     mixer1.gain(i, 1.0);
     mixer2.gain(i, 1.0);
   }
 
-  t->_fm = new TactileFileManager(tc);
- 
   tc->log2("TactileAudio::setup() complete.");
 
   return t;
@@ -104,6 +149,12 @@ const char *TactileAudio::getTrackName(int trackNum) {
   return _fm->getFileName(trackNum);
 }
 
+uint32_t TactileAudio::getTrackDuration(int trackNum) {
+  if (trackNum < 0 || trackNum >= NUM_TRACKS)
+    return 0;
+  return _fm->getDuration(trackNum);
+}
+
 /*----------------------------------------------------------------------
  * Volume controls
  ----------------------------------------------------------------------*/
@@ -111,8 +162,18 @@ const char *TactileAudio::getTrackName(int trackNum) {
 void TactileAudio::_setActualVolume(int trackNum, int percent) {
   _actualVolume[trackNum] = percent;
   float gain  = (float)percent/100.0;  // Convert percent (0-100) to gain (0-1.0)
+  gain *= _normalizeGain[trackNum];
   mixer1.gain(trackNum, gain);
   mixer2.gain(trackNum, gain);
+  _status[trackNum].gain = gain;
+}
+
+// Loudness normalization costs nothing while playing: the file's gain is
+// just part of the track's mixer gain.
+
+void TactileAudio::_setNormalizeGain(int trackNum, int dirNum, int fileNum) {
+  _normalizeGain[trackNum] = _normalize ? _fm->getNormalizeGain(dirNum, fileNum) : 1.0;
+  _setActualVolume(trackNum, _actualVolume[trackNum]);
 }
 
 void TactileAudio::setVolume(int trackNum, int percent) {
@@ -121,8 +182,10 @@ void TactileAudio::setVolume(int trackNum, int percent) {
   else if (trackNum >= NUM_TRACKS)
     trackNum = NUM_TRACKS - 1;
   _targetVolume[trackNum] = percent;
-  if (!_fadeInTime)
+  if (!_fadeInTime && (!_stemMode || _stemActive[trackNum]))  // stems are always running; keep idle ones silent
     _setActualVolume(trackNum, percent);
+  else if (_fadeInTime)
+    _startFade(trackNum, millis());       // the fade-in moves toward the new volume
 }
 
 void TactileAudio::setVolume(int percent) {
@@ -148,6 +211,26 @@ void TactileAudio::cancelFades(int trackNumber) {
   
 int TactileAudio::cancelAll() {
   int cancelled = 0;
+
+  // Stems never stop; cancelling just silences them. Stems that are
+  // fading out are left to finish.
+  if (_stemMode) {
+    for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
+      if (_stemActive[trackNumber]) {
+        _stemActive[trackNumber] = false;
+        _setActualVolume(trackNumber, 0);
+        _lastStartTime[trackNumber] = 0;
+        cancelled++;
+      }
+      if (_isPaused[trackNumber]) {
+        _isPaused[trackNumber] = false;
+        cancelled++;
+      }
+    }
+    updateTrackStatus();
+    return cancelled;
+  }
+
   for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
     AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
     if (!player) return 0;
@@ -155,9 +238,11 @@ int TactileAudio::cancelAll() {
       player->stop();
       cancelled++;
     }
+    _isPaused[trackNumber] = false;
     _lastStartTime[trackNumber] = 0;
     _lastStopTime[trackNumber] = 0;
   }
+  updateTrackStatus();
   return cancelled;
 }    
 
@@ -167,10 +252,183 @@ int TactileAudio::cancelAll() {
 
 void TactileAudio::setPlayRandomTrackMode(bool r) {
   _randomTrackMode = r;
+  setLoopMode(_loopMode);
+
+  // Read the directories now, rather than when a sensor is first touched
+  if (r) {
+    for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
+      if (_trackDir[trackNumber] >= 0)
+        _fm->getNumFiles(_trackDir[trackNumber]);
+    }
+  }
+}
+
+bool TactileAudio::setTrackDirectory(int trackNumber, const char *path) {
+  if (trackNumber < 0 || trackNumber >= NUM_TRACKS)
+    return false;
+  int dirNum = _fm->findDirectory(path);
+  _trackDir[trackNumber] = dirNum;
+  _playlist[trackNumber].setNumFiles(0);
+  if (dirNum < 0) {
+    _tc->logAction("TactileAudio: setTrackDirectory: no such directory for track ", trackNumber);
+    return false;
+  }
+  if (_randomTrackMode)
+    _fm->getNumFiles(dirNum);
+  return true;
+}
+
+void TactileAudio::setPlaylistMode(int mode) {
+  for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++)
+    _playlist[trackNumber].setMode(mode);
+  _tc->logAction2("TactileAudio: setPlaylistMode: ", mode);
+}
+
+bool TactileAudio::setRandomTrackWeight(int trackNumber, const char *fileName, int weight) {
+  if (trackNumber < 0 || trackNumber >= NUM_TRACKS || _trackDir[trackNumber] < 0)
+    return false;
+  int dirNum = _trackDir[trackNumber];
+  int numFiles = _fm->getNumFiles(dirNum);
+  _playlist[trackNumber].setNumFiles(numFiles);
+  for (int fileNum = 0; fileNum < numFiles; fileNum++) {
+    if (strcmp(_fm->getFileName(dirNum, fileNum), fileName) == 0)
+      return _playlist[trackNumber].setWeight(fileNum, weight);
+  }
+  _tc->log("TactileAudio: setRandomTrackWeight: no such file:");
+  _tc->log(fileName);
+  return false;
+}
+
+// Restores the playlists from EEPROM (if they're for the same number of
+// files, in the same mode), and from then on saves them whenever they
+// change, while nothing is playing (see doIOTasks()).
+
+void TactileAudio::setPlaylistSaving(bool on) {
+  _savePlaylists = on;
+  if (!on)
+    return;
+  for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
+    if (_trackDir[trackNumber] < 0)
+      continue;
+    _playlist[trackNumber].setNumFiles(_fm->getNumFiles(_trackDir[trackNumber]));
+    TactilePlaylistState state;
+    EEPROM.get(PLAYLIST_EEPROM_ADDR + trackNumber * sizeof(state), state);
+    if (_playlist[trackNumber].setState(&state))
+      _tc->logAction2("TactileAudio: playlist restored for track ", trackNumber);
+  }
+}
+
+void TactileAudio::_savePlaylistStates() {
+  for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
+    if (_playlist[trackNumber].isChanged()) {
+      EEPROM.put(PLAYLIST_EEPROM_ADDR + trackNumber * sizeof(TactilePlaylistState),
+                 *_playlist[trackNumber].getState());
+      return;                           // one per call
+    }
+  }
+}
+
+void TactileAudio::setSkipLeadingSilence(bool on) {
+  _skipSilence = on;
+  _fm->setSilenceScan(on);      // find the silence in any files that aren't indexed yet
+}
+
+void TactileAudio::setNormalizeMode(bool on) {
+  _normalize = on;
+  _fm->setLoudnessScan(on);     // measure any files that haven't been yet
+  _tc->logAction2("TactileAudio: setNormalizeMode: ", on);
 }
 
 void TactileAudio::setLoopMode(bool on) {
   _loopMode = on;
+
+  // Players loop by themselves, except in random mode where each loop
+  // picks a new track (see doTimerTasks()).
+  for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++)
+    _getPlayerByTrack(trackNumber)->setLoop(_loopMode && !_randomTrackMode);
+}
+
+/*----------------------------------------------------------------------
+ * Stem mode. The root-directory tracks are multitrack "stems" of one
+ * piece. They are all started together in the same audio block when
+ * stem mode is turned on and play continuously, looping in sync. The
+ * sensors only control each stem's volume: starting a track fades it
+ * up, stopping or pausing it fades it down, so there's no SD card
+ * activity at all when a sensor is touched. The stems are opened in the
+ * background, like any other track (see doIOTasks()), and only started
+ * once they're all ready.
+ ----------------------------------------------------------------------*/
+
+void TactileAudio::setStemMode(bool on) {
+  if (on == _stemMode)
+    return;
+  if (on) {
+    if (_randomTrackMode)
+      tactileLog.println("WARNING: stem mode plays the root-directory tracks; random-track mode ignored.");
+    cancelAll();
+    _stemMode = true;
+    _startStems();
+  } else {
+    _stemMode = false;
+    _stopStems();
+  }
+  updateTrackStatus();
+  _tc->logAction2("TactileAudio: setStemMode: ", on);
+}
+
+void TactileAudio::_startStems() {
+  int numStems = 0;
+  for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
+    _stemActive[trackNumber] = false;
+    _isPaused[trackNumber] = false;
+    _setActualVolume(trackNumber, 0);
+    const char *trackName = _fm->getFileName(trackNumber);
+    if (!trackName || !trackName[0])
+      continue;
+    if (numStems >= _maxVoices) {
+      _tc->logAction("TactileAudio: stem mode: SD card too slow, not playing track ", trackNumber);
+      continue;
+    }
+    AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
+    if (!player) return;
+    _setNormalizeGain(trackNumber, ROOT_DIR, trackNumber);
+    if (player->queuePrepare(trackName, true, 0, _fm->getFileSystem(trackNumber), _fm->getWavInfo(trackNumber)))
+      numStems++;
+    else
+      _tc->logAction("TactileAudio: stem mode: can't play track ", trackNumber);
+  }
+  _stemsStarting = numStems > 0;
+}
+
+// Called once no player has any opening left to do: every stem is primed
+// (or failed, see PLAYER_EVENT_ERROR), so release them inside one audio
+// update.
+
+void TactileAudio::_releaseStems() {
+  _stemsStarting = false;
+  int numStems = 0;
+  AudioNoInterrupts();
+  for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
+    AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
+    if (player->isPlaying()) {
+      player->start();
+      numStems++;
+    }
+  }
+  AudioInterrupts();
+  _tc->logAction("TactileAudio: stem mode, stems started: ", numStems);
+}
+
+void TactileAudio::_stopStems() {
+  _stemsStarting = false;
+  for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
+    _getPlayerByTrack(trackNumber)->stop();
+    _setActualVolume(trackNumber, 0);
+    _stemActive[trackNumber] = false;
+    _isPaused[trackNumber] = false;
+    _lastStartTime[trackNumber] = 0;
+    _lastStopTime[trackNumber] = 0;
+  }
 }
 
 AudioPlaySdWavPR *TactileAudio::_getPlayerByTrack(int trackNumber) {
@@ -188,108 +446,326 @@ AudioPlaySdWavPR *TactileAudio::_getPlayerByTrack(int trackNumber) {
   return NULL;  // to keep compiler happy, never happens
 }
 
+int TactileAudio::_getTrackByPlayerId(int playerId) {
+  for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
+    if (_getPlayerByTrack(trackNumber)->playerId() == playerId)
+      return trackNumber;
+  }
+  return -1;
+}
+
 void TactileAudio::startTrack(int trackNumber) {
+  uint32_t now = AudioPlaySdWavPR::sampleTime();
+  if (_quantizeSamples > 0) {
+    uint32_t beat = _lastBeat(now);             // snap to the next beat
+    if (beat != now)
+      now = beat + _quantizeSamples;
+  }
+  scheduleStart(trackNumber, now);
+}
+
+// Starts a track at an exact sample time (see getSampleTime()). The file
+// is opened by doIOTasks(), and the player starts it at that sample,
+// inside the audio update (or as soon as it's ready, if the file takes
+// longer to open). In stem mode the time is ignored, the stem is faded
+// up now.
+
+void TactileAudio::scheduleStart(int trackNumber, uint32_t sampleTime) {
   if (trackNumber < 0)
     trackNumber = 0;
   else if (trackNumber >= NUM_TRACKS)
     trackNumber = NUM_TRACKS - 1;
-  if (_randomTrackMode)
-    _startRandomTrack(trackNumber);
-  else
-    _startTrack(trackNumber);
+  if (_stemMode)
+    _stemActive[trackNumber] = true;    // already playing, just needs volume
+  else {
+    // The file is found before a voice is taken for it (see _getVoice()),
+    // so a track that can't start doesn't stop another one.
+    bool started = _randomTrackMode ? _startRandomTrack(trackNumber) : _startTrack(trackNumber);
+    if (!started)
+      return;
+    _getPlayerByTrack(trackNumber)->startAt(sampleTime);
+  }
+  _isPaused[trackNumber] = false;
   if (_fadeInTime == 0)
     _setActualVolume(trackNumber, _targetVolume[trackNumber]);
   else
     _thisFadeInTime[trackNumber] = _calculateFadeTime(trackNumber, true);
-  _lastStartTime[trackNumber] = millis();
+
+  // Fade-in is timed from when the track actually starts
+  int32_t delay = (int32_t)(sampleTime - AudioPlaySdWavPR::sampleTime());
+  if (_stemMode || delay < 0)
+    delay = 0;
+  _lastStartTime[trackNumber] = millis() + (uint32_t)((float)delay / (AUDIO_SAMPLE_RATE_EXACT / 1000.0f));
   _lastStopTime[trackNumber] = 0;
+  if (_fadeInTime != 0)
+    _startFade(trackNumber, _lastStartTime[trackNumber]);
+  _updateTrackStatus(trackNumber);
+}
+
+// Stops a track at an exact sample time, with no fade-out.
+
+void TactileAudio::scheduleStop(int trackNumber, uint32_t sampleTime) {
+  if (_stemMode) {
+    stopTrack(trackNumber);
+    return;
+  }
+  AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
+  if (!player) return;
+  player->stopAt(sampleTime);
+  _lastStartTime[trackNumber] = 0;      // not an end-of-track when it stops
+  _updateTrackStatus(trackNumber);
+  _tc->logAction2("TactileAudio: scheduled stop ", trackNumber);
+}
+
+/*----------------------------------------------------------------------
+ * Voice limits. A slow SD card can't feed every player at once, so
+ * rather than let all of them underrun, a new track either takes over
+ * from another one (a paused one if possible, otherwise the one started
+ * longest ago) or isn't played.
+ ----------------------------------------------------------------------*/
+
+bool TactileAudio::_getVoice(int trackNumber) {
+  int voices = 0;
+  int steal = -1;
+  for (int t = 0; t < NUM_TRACKS; t++) {
+    if (t == trackNumber || !_status[t].playing)
+      continue;
+    voices++;
+    if (steal < 0
+        || (_isPaused[t] && !_isPaused[steal])
+        || (_isPaused[t] == _isPaused[steal] && (int32_t)(_lastStartTime[t] - _lastStartTime[steal]) < 0))
+      steal = t;
+  }
+  if (voices < _maxVoices)
+    return true;
+  if (!_voiceStealing) {
+    _tc->logAction("TactileAudio: voice limit reached, not starting track ", trackNumber);
+    return false;
+  }
+  _tc->logAction("TactileAudio: voice limit reached, stopping track ", steal);
+  _getPlayerByTrack(steal)->stop();
+  _setActualVolume(steal, 0);
+  _isPaused[steal] = false;
+  _lastStartTime[steal] = 0;
+  _lastStopTime[steal] = 0;
+  _updateTrackStatus(steal);
+  return true;
+}
+
+// Measures the SD card and picks the read size that allows the most
+// voices. Each player reads readBlocks audio blocks at a time; on average
+// the reads mustn't take more than VOICE_READ_BUDGET_PCT of the time, and
+// even when every player reads in the same audio block they have to fit
+// in it.
+
+int TactileAudio::testSDCard() {
+  // Nothing may be playing during the test. Stems are always playing, so
+  // they're stopped, and started again (within the new limit) afterwards.
+  bool stems = _stemMode;
+  if (stems)
+    _stopStems();
+  if (!_audioIdle()) {
+    _tc->log("TactileAudio: can't test the SD card while tracks are playing");
+    return 0;
+  }
+  TactileSDTest result;
+  bool ok = _fm->testSDCard(&result);
+  if (ok)
+    _setVoicesForCard(&result);
+  if (stems)
+    _startStems();
+  return ok ? _maxVoices : 0;
+}
+
+void TactileAudio::_setVoicesForCard(const TactileSDTest *result) {
+  int bestVoices = 0;
+  int bestReadBlocks = 1;
+  int throughputVoices = result->sustainedKBps * VOICE_READ_BUDGET_PCT / 100 / VOICE_KBPS;
+  for (int size = 0; size < SD_TEST_READ_SIZES; size++) {
+    int readBlocks = 1 << size;
+    uint32_t readMicros = result->randomReadMicros[size] > 0 ? result->randomReadMicros[size] : 1;
+    int voices = PLAYER_BLOCK_MICROS * 9 / 10 / readMicros;
+    int average = PLAYER_BLOCK_MICROS * VOICE_READ_BUDGET_PCT / 100 * readBlocks / readMicros;
+    if (average < voices)
+      voices = average;
+    if (throughputVoices < voices)
+      voices = throughputVoices;
+    if (voices > bestVoices) {
+      bestVoices = voices;
+      bestReadBlocks = readBlocks;
+    }
+  }
+
+  if (bestVoices < 1) {
+    _tc->log("WARNING: the SD card is too slow to play even one track reliably");
+    bestVoices = 1;
+  }
+  setMaxVoices(bestVoices);
+  for (int trackNum = 0; trackNum < NUM_TRACKS; trackNum++)
+    _getPlayerByTrack(trackNum)->setReadBlocks(bestReadBlocks);
+  _tc->logAction("TactileAudio: SD card test: audio blocks per read: ", bestReadBlocks);
+}
+
+void TactileAudio::setMaxVoices(int voices) {
+  if (voices < 1)
+    voices = 1;
+  else if (voices > NUM_TRACKS)
+    voices = NUM_TRACKS;
+  _maxVoices = voices;
+  _tc->logAction("TactileAudio: maximum tracks playing at once: ", voices);
+}
+
+int TactileAudio::getMaxVoices() {
+  return _maxVoices;
 }
 
-void TactileAudio::_startTrack(int trackNumber) {
+void TactileAudio::setVoiceStealing(bool on) {
+  _voiceStealing = on;
+  _tc->logAction2("TactileAudio: setVoiceStealing: ", on);
+}
+
+uint32_t TactileAudio::getSampleTime() {
+  return AudioPlaySdWavPR::sampleTime();
+}
+
+void TactileAudio::setQuantizeGrid(int milliseconds) {
+  if (milliseconds < 0)
+    milliseconds = 0;
+  _quantizeSamples = (uint32_t)((float)milliseconds * (AUDIO_SAMPLE_RATE_EXACT / 1000.0f) + 0.5f);
+  _quantizeOrigin = AudioPlaySdWavPR::sampleTime();
+  _tc->logAction2("TactileAudio: setQuantizeGrid: ", milliseconds);
+}
+
+// The latest beat of the quantize grid at or before "now". The grid is
+// counted from its origin, not from sample 0: the sample clock wraps
+// around after about 27 hours, and a grid counted from 0 would jump
+// there unless the beat happened to divide 2^32. The origin is moved up
+// to each beat found, so the time since it never wraps (see also
+// doTimerTasks()).
+
+uint32_t TactileAudio::_lastBeat(uint32_t now) {
+  _quantizeOrigin = now - (now - _quantizeOrigin) % _quantizeSamples;
+  return _quantizeOrigin;
+}
+
+bool TactileAudio::_startTrack(int trackNumber) {
   const char *trackName = _fm->getFileName(trackNumber);
   if (!trackName) {
     _tc->logAction("Can't find that track: ", trackNumber);
-    return;
+    return false;
+  }
+  if (!_fm->isPlayable(trackNumber)) {
+    _tc->logAction("TactileAudio: can't play the file for track ", trackNumber);
+    return false;
+  }
+  if (!_fm->isCardPresent() && _fm->getFileSystem(trackNumber) == &SD) {
+    _tc->logAction2("TactileAudio: no SD card, can't start track ", trackNumber);
+    return false;
   }
   AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
-  if (!player) return;
-  player->play(trackName);
+  if (!player) return false;
+  if (!_getVoice(trackNumber))
+    return false;
+  if (!player->queuePrepare(trackName, false, _skipSilence ? _fm->getLeadingSilence(trackNumber) : 0,
+                            _fm->getFileSystem(trackNumber), _fm->getWavInfo(trackNumber)))
+    return false;
+  _setNormalizeGain(trackNumber, ROOT_DIR, trackNumber);
+  _fm->notePlayed(trackNumber);
   if (_tc->getLogLevel() > 1) {
-    Serial.print("TactileAudio: start track ");
-    Serial.print(trackNumber);
-    Serial.print(", ");
-    Serial.println(trackName);
+    tactileLog.print("TactileAudio: start track ");
+    tactileLog.print(trackNumber);
+    tactileLog.print(", ");
+    tactileLog.println(trackName);
   }
+  return true;
 }
 
-void TactileAudio::_startRandomTrack(int trackNumber) {
-  // Selects a track randomly from directory EN, where "N"
-  // is the track number (e.g. E0, E1, ...). However, it
-  // tries to avoid replaying the last-played "random" track.
+bool TactileAudio::_startRandomTrack(int trackNumber) {
+  // Selects a track randomly from the track's directory (by
+  // default EN, where "N" is the track number, i.e. E1, E2, ...).
+  // The track's playlist decides which (see TactilePlaylist.h).
 
   _tc->logAction2("TactileAudio: startRandomTrack ", trackNumber);
 
   AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
-  if (!player) return;
+  if (!player) return false;
 
-  int numFiles = _fm->getNumFiles(trackNumber);
+  int dirNum = _trackDir[trackNumber];
+  if (dirNum < 0) {
+    _tc->logAction("TactileAudio: no directory for random track ", trackNumber);
+    return false;
+  }
+  int numFiles = _fm->getNumFiles(dirNum);
   _tc->logAction2("TactileAudio: Files in directory: ", numFiles);
-  if (numFiles < 1) return;
+  if (numFiles < 1) return false;
 
-  int r;
-  int tries = 0;
-  while (tries < 30) {
-    r = random(numFiles);
-    if (r != _lastRandomTrackPlayed[trackNumber])       // avoid last track played
-      break;
-    tries++;
+  _playlist[trackNumber].setNumFiles(numFiles);   // (starts again if the directory changed)
+  int r = _playlist[trackNumber].next();
+  for (int tries = 1; tries < numFiles && !_fm->isPlayable(dirNum, r); tries++)
+    r = _playlist[trackNumber].next();  // (the file manager has already complained)
+  if (!_fm->isPlayable(dirNum, r)) {
+    _tc->logAction("TactileAudio: no playable files for random track ", trackNumber);
+    return false;
   }
-  _lastRandomTrackPlayed[trackNumber] = r;
   _tc->logAction2("TactileAudio: Random track selected: ", r);
-  const char *fileName = _fm->getFileName(trackNumber, r);
-  if (!fileName) {
+  char filePath[MAX_FILE_PATH + 1];
+  if (!_fm->getFilePath(filePath, dirNum, r)) {
     _tc->logAction2("Error, couldn't get random filename (this shouldn't happen) for track ", trackNumber);
-    return;
+    return false;
   }
-
-  char filePath[MAX_FILE_NAME+5] = "/Ex/";
-  filePath[2] = '1' + trackNumber;  // i.e. /E1/, /E2/, ...
-  strcpy(filePath+4, fileName);
   _tc->log2(filePath);
+  if (!_fm->isCardPresent() && _fm->getFileSystem(dirNum, r) == &SD) {
+    _tc->logAction2("TactileAudio: no SD card, can't start track ", trackNumber);
+    return false;
+  }
 
-  player->play(filePath);
+  if (!_getVoice(trackNumber))
+    return false;
+  if (!player->queuePrepare(filePath, false, _skipSilence ? _fm->getLeadingSilence(dirNum, r) : 0,
+                            _fm->getFileSystem(dirNum, r), _fm->getWavInfo(dirNum, r)))
+    return false;
+  _setNormalizeGain(trackNumber, dirNum, r);
+  _fm->notePlayed(dirNum, r);
 
   if (_tc->getLogLevel() > 1) {
-    Serial.print("TactileAudio: start random track: ");
-    Serial.print(filePath);
-    Serial.print(" (");
-    Serial.print(trackNumber);
-    Serial.print(", ");
-    Serial.print(r);
-    Serial.println(")");
+    tactileLog.print("TactileAudio: start random track: ");
+    tactileLog.print(filePath);
+    tactileLog.print(" (");
+    tactileLog.print(trackNumber);
+    tactileLog.print(", ");
+    tactileLog.print(r);
+    tactileLog.println(")");
   }
+  return true;
 }
 
 void TactileAudio::stopTrack(int trackNumber) {
   AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
   if (!player) return;
   if (_fadeOutTime == 0) {
-    player->stop();
+    if (!_stemMode)
+      player->stop();
     _setActualVolume(trackNumber, 0);
   } else {
     // If fade-out enabled, don't actually stop the track. That will happen
     // when fade-out finishes (see _doFadeInOut(), below).
     _thisFadeOutTime[trackNumber] = _calculateFadeTime(trackNumber, false);
   }
+  _stemActive[trackNumber] = false;
 
   _tc->logAction2("TactileAudio: stop ", trackNumber);
   _lastStopTime[trackNumber] = millis();  // for calculating fade-out
   _lastStartTime[trackNumber] = 0;
+  if (_fadeOutTime != 0)
+    _startFade(trackNumber, _lastStopTime[trackNumber]);
+  _updateTrackStatus(trackNumber);
 }  
 
 bool TactileAudio::isPlaying(int trackNumber) {
   AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
   if (!player) return 0;
+  if (_stemMode)
+    return _stemActive[trackNumber];
   return player->isPlaying();
 }
 
@@ -301,7 +777,8 @@ void TactileAudio::pauseTrack(int trackNumber) {
   AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
   if (!player) return; 
   if (_fadeOutTime == 0) {
-    player->pause();
+    if (!_stemMode)
+      player->pause();
     _setActualVolume(trackNumber, 0);
   } else {
     // If fade-out enabled, don't actually pause the track. That will happen
@@ -309,8 +786,12 @@ void TactileAudio::pauseTrack(int trackNumber) {
     _thisFadeOutTime[trackNumber] = _calculateFadeTime(trackNumber, false);
   }
   _isPaused[trackNumber] = true;
+  _stemActive[trackNumber] = false;
   _lastStartTime[trackNumber] = 0;
   _lastStopTime[trackNumber] = millis();     // for calculating fade-out
+  if (_fadeOutTime != 0)
+    _startFade(trackNumber, _lastStopTime[trackNumber]);
+  _updateTrackStatus(trackNumber);
   _tc->logAction2("TactileAudio: pause ", trackNumber);
 }
 
@@ -319,7 +800,10 @@ void TactileAudio::resumeTrack(int trackNumber) {
   AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
   if (!player) return;
 
-  player->resume();
+  if (_stemMode)
+    _stemActive[trackNumber] = true;
+  else
+    player->resume();
   _isPaused[trackNumber] = false;
   if (_fadeInTime == 0)
     _setActualVolume(trackNumber, _targetVolume[trackNumber]);
@@ -328,6 +812,9 @@ void TactileAudio::resumeTrack(int trackNumber) {
 
   _lastStartTime[trackNumber] = millis();
   _lastStopTime[trackNumber] = 0;
+  if (_fadeInTime != 0)
+    _startFade(trackNumber, _lastStartTime[trackNumber]);
+  _updateTrackStatus(trackNumber);
 
   _tc->logAction2("TactileAudio: resume ", trackNumber);
 }
@@ -336,6 +823,29 @@ bool TactileAudio::isPaused(int trackNumber) {
   return _isPaused[trackNumber];
 }
 
+/*----------------------------------------------------------------------
+ * Track status. The sensor loops and fades decide what to do from
+ * _status, which is read from the players once per pass of the main
+ * loop, and again for a track whenever it's started, stopped, paused or
+ * resumed, or its fade finishes. So every decision in a pass sees the
+ * same state, even if a player reaches the end of its file meanwhile.
+ ----------------------------------------------------------------------*/
+
+void TactileAudio::updateTrackStatus() {
+  for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++)
+    _updateTrackStatus(trackNumber);
+}
+
+void TactileAudio::_updateTrackStatus(int trackNumber) {
+  _status[trackNumber].playing = isPlaying(trackNumber);
+  _status[trackNumber].paused = _isPaused[trackNumber];
+}
+
+void TactileAudio::_startFade(int trackNumber, uint32_t when) {
+  _fadeTimers.set(trackNumber, when);
+  _status[trackNumber].fading = true;
+}
+
 int TactileAudio::_calculateFadeTime(int trackNumber, bool goingUp) {
   int deltaVolume;
   int fadeTime;
@@ -350,19 +860,25 @@ int TactileAudio::_calculateFadeTime(int trackNumber, bool goingUp) {
   return time;
 }
 
-void TactileAudio::_doFadeInOut(int trackNumber)
+// Moves a fade along. Returns true if it isn't finished (it's called
+// again FADE_STEP_MILLIS later; see doTimerTasks()).
+
+bool TactileAudio::_doFadeInOut(int trackNumber)
 {
   int targetVol = _targetVolume[trackNumber];
   int actualVol = _actualVolume[trackNumber];
+  AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
+  if (!player) return false;
 
   // Do fade-in? When fade-in is enabled, tracks are started at zero volume,
   // so they're initially in the "is playing" state even though the volume
   // is zero.
 
   if (_lastStartTime[trackNumber] > 0
+      && (int32_t)(millis() - _lastStartTime[trackNumber]) >= 0     // (scheduled starts may be in the future)
       && _fadeInTime != 0
       && actualVol < targetVol
-      && isPlaying(trackNumber)) {
+      && _status[trackNumber].playing) {
 
     // Calculate the target volume based on how much elapsed time since the track started playing.
     unsigned long elapsedTime = millis() - _lastStartTime[trackNumber];
@@ -383,6 +899,7 @@ void TactileAudio::_doFadeInOut(int trackNumber)
       _tc->logAction2("TactileAudio: Fade-in, set volume: ", newVolumePercent);
       _setActualVolume(trackNumber, newVolumePercent);
     }
+    return _actualVolume[trackNumber] < targetVol;
   }
 
   // Else -- do fade-out? When fade-out is enabled, a track can be in the "is stopped"
@@ -391,7 +908,7 @@ void TactileAudio::_doFadeInOut(int trackNumber)
 
   else if (_fadeOutTime != 0                            // fade-out is enabled
            && _lastStopTime[trackNumber] > 0            // the track is stopped or paused...
-           && isPlaying(trackNumber)                    // ... but the track is still playing
+           && (_stemMode || _status[trackNumber].playing)  // ... but the track is still playing
 	   && actualVol > 0) {                          // and volume hasn't reached zero yet
 
     // Calculate the target volume based on how much elapsed time since the track stopped playing.
@@ -416,10 +933,11 @@ void TactileAudio::_doFadeInOut(int trackNumber)
       // If fade-out reached zero volume, actually stop or pause the track.
       // Note that _isPaused is true as soon as pauseTrack()
       // is called, but the track keeps playing until this fade-out finishes.
+      // Stems are never stopped, they just keep running silently.
       if (newVolumePercent == 0) {
-        AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
-        if (!player) return;
-	if (isPaused(trackNumber)) {
+	if (_stemMode) {
+	  _tc->logAction2("TactileAudio: fade-out done, stem silent: ", trackNumber);
+	} else if (isPaused(trackNumber)) {
           player->pause();
 	  _tc->logAction2("TactileAudio: fade-out done, track paused: ", trackNumber);
 	} else {
@@ -427,8 +945,10 @@ void TactileAudio::_doFadeInOut(int trackNumber)
           _tc->logAction2("TactileAudio: fade-out done, track stopped: ", trackNumber);
 	}
         _lastStopTime[trackNumber] = 0;
+        _updateTrackStatus(trackNumber);
       }
     }
+    return _lastStopTime[trackNumber] > 0;
   }
   // No fade-in or fade-out
   // else {
@@ -441,31 +961,340 @@ void TactileAudio::_doFadeInOut(int trackNumber)
   //     }
   //   }
   // }
+
+  // A fade-in that's waiting for a scheduled start
+  return _lastStartTime[trackNumber] > 0 && _fadeInTime != 0
+    && (int32_t)(millis() - _lastStartTime[trackNumber]) < 0;
 }
 
 void TactileAudio::doTimerTasks()
 {
-  for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++)
-    _doFadeInOut(trackNumber);
+  // Fades that are due (nothing at all if none are in progress)
+  uint32_t now = millis();
+  int fadeTrack;
+  while ((fadeTrack = _fadeTimers.due(now)) >= 0) {
+    if (_doFadeInOut(fadeTrack))
+      _fadeTimers.set(fadeTrack, now + FADE_STEP_MILLIS);
+    else
+      _status[fadeTrack].fading = false;
+  }
+  PROFILE_MARK(PROFILE_FADES);
 
-  // If a track that was playing reached the end of the track, change its status.
-  for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
-    if (_lastStartTime[trackNumber] > 0) {
-      AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
-      if (!player) return;
-      uint32_t now = millis();
-      if (now - _lastStartTime[trackNumber] > 50) {  // Player doesn't reliably report isPlaying() for a
-        if (!player->isPlaying()) {                  // few msec, so if it just started playing, skip this.
-          if (_loopMode) {
-            startTrack(trackNumber);
-            _tc->logAction2("end of track, looping: ", trackNumber);
-          } else {
-            _lastStartTime[trackNumber] = 0;
-            _lastStopTime[trackNumber] = now;
-            _tc->logAction2("end of track ", trackNumber);
-          }
+  _doStatsTasks();
+
+  // Handle whatever the players have reported since last time.
+  AudioPlayerEvent event;
+  while (AudioPlaySdWavPR::getEvent(&event)) {
+    int trackNumber = _getTrackByPlayerId(event.player);
+    if (trackNumber < 0)
+      continue;
+    if (event.playId != _getPlayerByTrack(trackNumber)->playId())
+      continue;                                 // from a file that's since been replaced
+
+    switch (event.type) {
+
+    case PLAYER_EVENT_END:
+      // Stems never end, and a track that was already stopped (e.g. fading
+      // out) has nothing more to do.
+      if (_stemMode || _lastStartTime[trackNumber] == 0)
+        break;
+      if (_loopMode) {
+        startTrack(trackNumber);                // (random mode: picks a new track)
+        _tc->logAction2("end of track, looping: ", trackNumber);
+      } else {
+        _lastStartTime[trackNumber] = 0;
+        _lastStopTime[trackNumber] = millis();
+        _updateTrackStatus(trackNumber);
+        _tc->logAction2("end of track ", trackNumber);
+      }
+      break;
+
+    case PLAYER_EVENT_STARTED:
+      _startErrors[trackNumber] = 0;
+      break;
+
+    case PLAYER_EVENT_ERROR:
+      // The file couldn't be opened or played. In loop mode it's tried
+      // again (random mode: another file), but not forever.
+      _tc->logAction("TactileAudio: couldn't start track ", trackNumber);
+      if (_stemMode || _lastStartTime[trackNumber] == 0)
+        break;
+      if (_loopMode && ++_startErrors[trackNumber] < START_RETRIES) {
+        startTrack(trackNumber);
+        break;
+      }
+      _startErrors[trackNumber] = 0;
+      _lastStartTime[trackNumber] = 0;
+      _lastStopTime[trackNumber] = millis();
+      _updateTrackStatus(trackNumber);
+      break;
+
+    case PLAYER_EVENT_LOOPED:
+      _tc->logAction2("TactileAudio: track looped: ", trackNumber);
+      break;
+
+    case PLAYER_EVENT_UNDERRUN:
+      _tc->logAction2("TactileAudio: underrun, track ", trackNumber);
+      break;
+    }
+  }
+
+  // Keep the quantize grid's origin within a few hours of the sample clock
+  if (_quantizeSamples > 0 && AudioPlaySdWavPR::sampleTime() - _quantizeOrigin >= QUANTIZE_REBASE_SAMPLES)
+    _lastBeat(AudioPlaySdWavPR::sampleTime());
+}
+
+// Cooperative I/O. Each call does one short piece of SD card work, so
+// the main loop never waits long for the card and the sensors keep being
+// read while tracks are opened. Players that are opening a track take
+// turns; the leading-silence scan only runs when they're all idle, and
+// copying to the flash tier only when nothing is playing at all.
+// Returns true if a track is being opened, i.e. it should be called again
+// right away.
+
+bool TactileAudio::doIOTasks()
+{
+  for (int i = 0; i < NUM_TRACKS; i++) {
+    _ioNextTrack = (_ioNextTrack + 1) % NUM_TRACKS;
+    if (_getPlayerByTrack(_ioNextTrack)->serviceIO())
+      return true;
+  }
+  if (_stemsStarting)
+    _releaseStems();
+  bool idle = _audioIdle();
+  _fm->doBackgroundTasks(idle);
+  _checkCard();
+
+  // Writing EEPROM holds up the flash, so not while playing
+  if (_savePlaylists && idle)
+    _savePlaylistStates();
+  return false;
+}
+
+// When the SD card is taken out, the tracks playing from it are stopped
+// (tracks playing from the flash tier carry on). In stem mode the stems
+// are started again, in sync, once the card is back and the catalog has
+// been checked.
+
+void TactileAudio::_checkCard() {
+  if (_fm->isCardPresent() != _cardPresent) {
+    _cardPresent = _fm->isCardPresent();
+    if (!_cardPresent) {
+      for (int trackNumber = 0; trackNumber < NUM_TRACKS; trackNumber++) {
+        AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
+        if (player->fileSystem() == &SD) {
+          player->stop();
+          _tc->logAction("TactileAudio: SD card removed, stopped track ", trackNumber);
         }
       }
+      updateTrackStatus();
+    }
+    _restartStems = _stemMode && _cardPresent;
+  }
+  if (_restartStems && !_fm->isRefreshing()) {
+    _restartStems = false;
+    if (_stemMode) {
+      _stopStems();
+      _startStems();
+      updateTrackStatus();
+    }
+  }
+}
+
+bool TactileAudio::_audioIdle() {
+  for (int trackNum = 0; trackNum < NUM_TRACKS; trackNum++) {
+    if (_getPlayerByTrack(trackNum)->isPlaying())
+      return false;
+  }
+  return true;
+}
+
+void TactileAudio::setFlashTierMode(bool on) {
+  if (on)
+    _fm->useDefaultFlashTier();
+  else
+    _fm->setFlashTier(NULL);
+}
+
+bool TactileAudio::setFlashTier(FS *fs) {
+  return _fm->setFlashTier(fs);
+}
+
+// The Audio library can't power the codec down, so this mutes its
+// headphone and line outputs, which stops them driving the load. The
+// codec keeps running, so sound comes back instantly.
+
+void TactileAudio::setOutputPower(bool on) {
+  if (on == _outputOn)
+    return;
+  _outputOn = on;
+  if (on) {
+    sgtl5000.unmuteHeadphone();
+    sgtl5000.unmuteLineout();
+  } else {
+    sgtl5000.muteHeadphone();
+    sgtl5000.muteLineout();
+  }
+  _tc->logAction2("TactileAudio: output power: ", on);
+}
+
+bool TactileAudio::getOutputPower() {
+  return _outputOn;
+}
+
+/*----------------------------------------------------------------------
+ * Audio resource usage. The Audio library keeps the CPU and memory
+ * figures; these just collect them in one place, log them now and then,
+ * and remember the peak memory use so that the next startup can size the
+ * pool to fit.
+ ----------------------------------------------------------------------*/
+
+void TactileAudio::getAudioStats(TactileAudioStats *stats) {
+  stats->cpu             = AudioProcessorUsage();
+  stats->cpuMax          = AudioProcessorUsageMax();
+  for (int trackNum = 0; trackNum < NUM_TRACKS; trackNum++)
+    stats->playerCpuMax[trackNum] = _getPlayerByTrack(trackNum)->processorUsageMax();
+  stats->mixerCpuMax     = mixer1.processorUsageMax() + mixer2.processorUsageMax();
+  stats->outputCpuMax    = i2s1.processorUsageMax();
+  stats->blocksUsed      = AudioMemoryUsage();
+  stats->blocksUsedMax   = AudioMemoryUsageMax();
+  stats->blocksAllocated = _audioBlocks;
+}
+
+void TactileAudio::resetAudioStats() {
+  AudioProcessorUsageMaxReset();
+  AudioMemoryUsageMaxReset();
+  for (int trackNum = 0; trackNum < NUM_TRACKS; trackNum++) {
+    _getPlayerByTrack(trackNum)->processorUsageMaxReset();
+    _getPlayerByTrack(trackNum)->resetStats();
+  }
+  mixer1.processorUsageMaxReset();
+  mixer2.processorUsageMaxReset();
+  i2s1.processorUsageMaxReset();
+}
+
+void TactileAudio::getPlayerStats(int trackNumber, AudioPlayerStats *stats) {
+  AudioPlaySdWavPR *player = _getPlayerByTrack(trackNumber);
+  if (player)
+    player->getStats(stats);
+  else
+    memset(stats, 0, sizeof(*stats));
+}
+
+// Prints each player's read latency histogram, e.g.
+//   Track 1: 5120 reads, max 3120 us, 0 underruns, 1 late
+//     <2 us: 0, 2 us: 0, 4 us: 0, ... 128 us: 4980, 256 us: 139, ...
+
+void TactileAudio::printPlayerStats() {
+  for (int trackNum = 0; trackNum < NUM_TRACKS; trackNum++) {
+    AudioPlayerStats stats;
+    getPlayerStats(trackNum, &stats);
+    tactileLog.print("Track ");
+    tactileLog.print(trackNum + 1);
+    tactileLog.print(": ");
+    tactileLog.print(stats.reads);
+    tactileLog.print(" reads, max ");
+    tactileLog.print(stats.maxReadMicros);
+    tactileLog.print(" us, ");
+    tactileLog.print(stats.underruns);
+    tactileLog.print(" underruns, ");
+    tactileLog.print(stats.lateBlocks);
+    tactileLog.println(" late");
+    tactileLog.print("  <2 us: ");
+    tactileLog.print(stats.readLatency[0]);
+    for (int bucket = 1; bucket < PLAYER_LATENCY_BUCKETS; bucket++) {
+      tactileLog.print(", ");
+      tactileLog.print(1UL << bucket);
+      tactileLog.print(bucket == PLAYER_LATENCY_BUCKETS - 1 ? "+ us: " : " us: ");
+      tactileLog.print(stats.readLatency[bucket]);
+    }
+    tactileLog.println();
+  }
+}
+
+uint32_t TactileAudio::getAudioPoolBytesUsed() {
+  return _audioBlocks * sizeof(audio_block_t);
+}
+
+uint32_t TactileAudio::getPlaylistBytes() {
+  uint32_t bytes = 0;
+  for (int trackNum = 0; trackNum < NUM_TRACKS; trackNum++)
+    bytes += _playlist[trackNum].getMemoryBytes();
+  return bytes;
+}
+
+void TactileAudio::setAudioStatsInterval(int milliseconds) {
+  _statsLogInterval = milliseconds < 0 ? 0 : milliseconds;
+  _tc->logAction2("TactileAudio: setAudioStatsInterval: ", milliseconds);
+}
+
+void TactileAudio::_doStatsTasks() {
+  uint32_t now = millis();
+
+  if (_statsLogInterval > 0 && now - _lastStatsLogTime >= _statsLogInterval) {
+    _lastStatsLogTime = now;
+    TactileAudioStats stats;
+    getAudioStats(&stats);
+    if (_tc->getLogLevel() > 0) {
+      tactileLog.print("TactileAudio: CPU ");
+      tactileLog.print(stats.cpu);
+      tactileLog.print("% (max ");
+      tactileLog.print(stats.cpuMax);
+      tactileLog.print("%, players");
+      for (int trackNum = 0; trackNum < NUM_TRACKS; trackNum++) {
+        tactileLog.print(" ");
+        tactileLog.print(stats.playerCpuMax[trackNum]);
+      }
+      tactileLog.print(", mixers ");
+      tactileLog.print(stats.mixerCpuMax);
+      tactileLog.print(", output ");
+      tactileLog.print(stats.outputCpuMax);
+      tactileLog.print("), memory ");
+      tactileLog.print(stats.blocksUsed);
+      tactileLog.print("/");
+      tactileLog.print(stats.blocksAllocated);
+      tactileLog.print(" blocks (max ");
+      tactileLog.print(stats.blocksUsedMax);
+      tactileLog.println(")");
     }
   }
+
+  // Save a new peak, but not while playing: SD card writes can be slow.
+  if (now - _lastStatsCheckTime < AUDIO_STATS_CHECK_INTERVAL)
+    return;
+  _lastStatsCheckTime = now;
+  int peak = AudioMemoryUsageMax();
+  if (peak > _savedBlocksPeak && _audioIdle()) {
+    if (peak >= _audioBlocks)
+      _tc->log("TactileAudio: ran out of audio memory; more will be allocated at next startup");
+    _writeAudioMemoryPeak(peak);
+    _savedBlocksPeak = peak;
+  }
+}
+
+int TactileAudio::_readAudioMemoryPeak() {
+  File file = SD.open(AUDIO_MEMORY_FILE);
+  if (!file)
+    return 0;
+  char line[12];
+  int len = file.read(line, sizeof(line) - 1);
+  file.close();
+  if (len <= 0)
+    return 0;
+  line[len] = 0;
+  int peak = atoi(line);
+  return (peak > 0 && peak <= AUDIO_BLOCKS_MAX) ? peak : 0;
+}
+
+void TactileAudio::_writeAudioMemoryPeak(int peak) {
+  char line[12];
+  snprintf(line, sizeof(line), "%d\n", peak);
+  AudioNoInterrupts();
+  SD.remove(AUDIO_MEMORY_FILE);
+  File file = SD.open(AUDIO_MEMORY_FILE, FILE_WRITE);
+  if (file) {
+    file.write(line, strlen(line));
+    file.close();
+  }
+  AudioInterrupts();
 }
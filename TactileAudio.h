@@ -30,6 +30,62 @@
 #include "TactileCPU.h"
 #include "TactileFileManager.h"
 #include "AudioPlaySdWavPR.h"     // extension of Audio.h that adds pause/resume feature
+#include "TactilePlaylist.h"
+#include "TactileTimers.h"
+
+// Audio memory. Each voice holds one block per channel while it's being
+// mixed, and the mixers and output hold a few more. The pool is sized at
+// startup from the voice count and the peak measured on earlier runs
+// (saved in AUDIO_MEMORY_FILE), never more than AUDIO_BLOCKS_MAX.
+#define AUDIO_BLOCKS_PER_VOICE    2
+#define AUDIO_BLOCKS_FIXED        4
+#define AUDIO_BLOCKS_HEADROOM     4
+#define AUDIO_BLOCKS_MAX          (AUDIO_BLOCKS_PER_VOICE*NUM_TRACKS + AUDIO_BLOCKS_FIXED + 4*AUDIO_BLOCKS_HEADROOM)
+#define AUDIO_MEMORY_FILE         "/_AUDIOMEM.TXT"
+#define AUDIO_STATS_CHECK_INTERVAL 1000     // milliseconds
+
+// Voice limits from the SD card test: the share of each audio block's
+// time that file reads may take on average, and the data rate of one
+// (stereo, 16-bit, 44.1 kHz) voice.
+#define VOICE_READ_BUDGET_PCT     50
+#define VOICE_KBPS                173
+
+// Static memory for audio, known when compiling
+#define AUDIO_POOL_BYTES          (AUDIO_BLOCKS_MAX * sizeof(audio_block_t))
+#define AUDIO_PLAYER_BYTES        (NUM_TRACKS * sizeof(AudioPlaySdWavPR))
+
+#define FADE_STEP_MILLIS          3         // fades are updated this often (about an audio block)
+
+#define START_RETRIES             3         // loop mode: gives up starting a track after this many failures in a row
+
+#define QUANTIZE_REBASE_SAMPLES   0x40000000UL  // move the quantize grid's origin up after this long (about 6.8 hours)
+
+#define AUDIO_OUTPUT_MA           10.0      // the codec's outputs, when on (rough figure, for power estimates)
+
+// Random-track mode's playlists are saved in EEPROM from here, one
+// TactilePlaylistState per track (see setPlaylistSaving())
+#define PLAYLIST_EEPROM_ADDR      0
+
+struct TactileAudioStats {
+  float    cpu;                       // percent of the CPU used by audio, right now
+  float    cpuMax;                    // peak since the last reset
+  float    playerCpuMax[NUM_TRACKS];  // peak, per track's player
+  float    mixerCpuMax;               // peak, both mixers
+  float    outputCpuMax;              // peak, I2S output
+  int      blocksUsed;                // audio memory blocks in use, right now
+  int      blocksUsedMax;             // peak since the last reset
+  int      blocksAllocated;           // size of the pool
+};
+
+// A track's state, as of the start of this pass of the loop (see
+// updateTrackStatus()), or since it was last started, stopped, paused or
+// resumed.
+struct TactileTrackStatus {
+  bool     playing;                   // as isPlaying()
+  bool     paused;                    // as isPaused()
+  bool     fading;                    // a fade-in or fade-out is under way
+  float    gain;                      // the track's mixer gain (volume and normalizing)
+};
 
 class TactileAudio
 {
@@ -38,7 +94,8 @@ class TactileAudio
   TactileAudio(TactileCPU *tc);
   static TactileAudio* setup(TactileCPU *tc);
 
-  const char *getTrackName(int trackNum);
+  const char *getTrackName(int trackNum);      // valid until the next doIOTasks(); copy to keep
+  uint32_t    getTrackDuration(int trackNum);   // milliseconds
 
   void setVolume(int percent);
   void setVolume(int trackNumber, int percent);
@@ -47,19 +104,61 @@ class TactileAudio
   void cancelFades(int trackNumber);
 
   void setPlayRandomTrackMode(bool r);
+  bool setTrackDirectory(int trackNumber, const char *path);   // for random-track mode
+  void setPlaylistMode(int mode);             // PLAYLIST_SHUFFLE, _WEIGHTED or _SEQUENTIAL
+  bool setRandomTrackWeight(int trackNumber, const char *fileName, int weight);
+  void setPlaylistSaving(bool on);            // true == keep the playlists' places in EEPROM
   void setLoopMode(bool on);
+  void setStemMode(bool on);
+  void setSkipLeadingSilence(bool on);
+  void setNormalizeMode(bool on);             // true == each file plays at the same loudness
+  void setFlashTierMode(bool on);
+  bool setFlashTier(FS *fs);                  // any file system, e.g. LittleFS_RAM for testing; NULL == off
+  void setOutputPower(bool on);               // false == codec's outputs muted, to save power
+  bool getOutputPower();
+  bool isAudioIdle() { return _audioIdle(); }  // no player busy, stems and paused tracks included
 
   void startTrack(int sensorNumber);
   void stopTrack(int sensorNumber);
   bool isPlaying(int sensorNumber);
 
+  // Sample-accurate timing: times are in samples, on the audio clock
+  uint32_t getSampleTime();
+  void scheduleStart(int sensorNumber, uint32_t sampleTime);
+  void scheduleStop(int sensorNumber, uint32_t sampleTime);
+  void setQuantizeGrid(int milliseconds);     // startTrack() waits for the next beat; 0 == off
+
   void pauseTrack(int sensorNumber);
   void resumeTrack(int sensorNumber);
   bool isPaused(int sensorNumber);
 
   int  cancelAll();
 
+  // Every track's state, read once per pass rather than asked of the
+  // players over and over (they can change underneath, in the audio update)
+  void updateTrackStatus();
+  const TactileTrackStatus *getTrackStatus() { return _status; }   // NUM_TRACKS of them
+
+  // Audio resource usage
+  void getAudioStats(TactileAudioStats *stats);
+  void resetAudioStats();
+  void setAudioStatsInterval(int milliseconds);   // log a summary this often; 0 == never
+  void getPlayerStats(int trackNumber, AudioPlayerStats *stats);  // SD read latency, underruns
+
+  // Voice limits. testSDCard() sets the limit and read size to suit the card.
+  int  testSDCard();                          // returns the voice limit, 0 if the test failed or anything's playing
+  void setMaxVoices(int voices);
+  int  getMaxVoices();
+  void setVoiceStealing(bool on);             // at the limit: true == stop the oldest track, false == refuse
+  void printPlayerStats();
+
   void doTimerTasks();
+  bool doIOTasks();
+
+  // Memory (see Tactile::getMemoryBudget())
+  uint32_t getAudioPoolBytesUsed();           // the part of the pool that's in use
+  uint32_t getPlaylistBytes();                // heap
+  TactileFileManager *getFileManager() { return _fm; }
   
  private:
 
@@ -69,28 +168,70 @@ class TactileAudio
   // Volume control
   int _targetVolume[NUM_TRACKS];
   int _actualVolume[NUM_TRACKS];
+  float _normalizeGain[NUM_TRACKS];         // of the file the track is playing
   int _fadeInTime;
   int _fadeOutTime;
 
   bool _randomTrackMode;
   bool _loopMode;
+  bool _stemMode;
+  uint32_t _quantizeSamples;
+  uint32_t _quantizeOrigin;               // sample time of a beat of the grid
+  bool _skipSilence;
+  bool _normalize;
+  int  _ioNextTrack;
+  int  _maxVoices;
+  bool _voiceStealing;
+  bool _cardPresent;
+  bool _restartStems;                     // after the SD card went back in
+  bool _stemsStarting;                    // stems being opened, to be started together
+
+  // Audio resource usage
+  int      _audioBlocks;
+  int      _savedBlocksPeak;
+  uint32_t _statsLogInterval;
+  uint32_t _lastStatsLogTime;
+  uint32_t _lastStatsCheckTime;
 
   // Audio player status (per track)
   uint32_t _lastStartTime[NUM_TRACKS];
   uint32_t _lastStopTime[NUM_TRACKS];
+  uint8_t  _startErrors[NUM_TRACKS];    // failures to start, in a row
   int      _thisFadeInTime[NUM_TRACKS];
   int      _thisFadeOutTime[NUM_TRACKS];
-  int      _lastRandomTrackPlayed[NUM_TRACKS];
+  int      _trackDir[NUM_TRACKS];       // random-track mode: directory number, or -1
+  TactilePlaylist _playlist[NUM_TRACKS];  // random-track mode: which file next
+  bool     _savePlaylists;
+  bool     _outputOn;
   bool     _isPaused[NUM_TRACKS];
+  bool     _stemActive[NUM_TRACKS];        // stem mode: sensor wants this stem audible
+  TactileTimers _fadeTimers;               // by track number: when to update its fade
+  TactileTrackStatus _status[NUM_TRACKS];
   
   // Internal methods
   AudioPlaySdWavPR *_getPlayerByTrack(int trackNumber);
+  int     _getTrackByPlayerId(int playerId);
   uint8_t _volumePctToByte(int percent);
   void    _setActualVolume(int trackNum, int percent);
+  void    _setNormalizeGain(int trackNum, int dirNum, int fileNum);
   int     _calculateFadeTime(int trackNumber, bool goingUp);
-  void    _doFadeInOut(int trackNumber);
-  void    _startTrack(int trackNumber);
-  void    _startRandomTrack(int trackNumber);
+  bool    _doFadeInOut(int trackNumber);
+  uint32_t _lastBeat(uint32_t now);
+  void    _setVoicesForCard(const TactileSDTest *result);
+  void    _startFade(int trackNumber, uint32_t when);
+  void    _updateTrackStatus(int trackNumber);
+  bool    _startTrack(int trackNumber);           // false: no file, or no voice for it
+  bool    _startRandomTrack(int trackNumber);
+  void    _startStems();
+  void    _stopStems();
+  void    _releaseStems();
+  bool    _audioIdle();
+  void    _checkCard();
+  void    _savePlaylistStates();
+  bool    _getVoice(int trackNumber);
+  int     _readAudioMemoryPeak();
+  void    _writeAudioMemoryPeak(int peak);
+  void    _doStatsTasks();
 };
 
 #endif
@@ -25,11 +25,20 @@
 
 // Number of available tracks, referenced as 0 to (NUM_TRACKS-1)
 // Note: should be the same as the number of sensors, above.
-// This is also the number of subdirectories for selecting random tracks.
+// Each track can also have a directory for selecting random tracks.
 #define NUM_TRACKS 4
-#define NUM_SUBDIRS 4
-#define NUM_TRACKS_IN_SUBDIR 100
 
 // Max string length of filename on SD card
 #define MAX_FILE_NAME 255
 
+// The engine's objects (Tactile, TactileCPU, TactileSensors, TactileAudio
+// and TactileFileManager) are each made once, by setup(), in static
+// storage rather than on the heap, e.g.
+//     TactileAudio *t = new(tactileStorage<TactileAudio>()) TactileAudio(tc);
+// so their memory is fixed and counted in the compiler's RAM report.
+#include <new>
+template <class T> void *tactileStorage() {
+  alignas(T) static unsigned char storage[sizeof(T)];
+  return storage;
+}
+
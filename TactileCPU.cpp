@@ -20,12 +20,94 @@
 
 #include "Arduino.h"
 #include "TactileCPU.h"
+#include "TactileProfiler.h"
+
+extern "C" uint32_t set_arm_clock(uint32_t frequency);    // Teensy 4 core
+
+TactileLog tactileLog;
+
+TactileLog::TactileLog() {
+  _head = 0;
+  _tail = 0;
+  _write = 0;
+  _dropping = false;
+  _dropped = 0;
+  _droppedReported = 0;
+  _async = false;
+}
+
+void TactileLog::setAsync(bool on) {
+  if (!on) {
+    while (drain() && Serial)
+      ;                                 // (waits for Serial, if it's connected)
+  }
+  _async = on;
+}
+
+// Indexes run freely and wrap around; the buffer position is the index
+// modulo the size. A line only becomes visible to drain() when its
+// newline moves _head, so drain() never sends part of one.
+
+size_t TactileLog::write(uint8_t b) {
+  if (!_async)
+    return Serial.write(b);
+  if (!_dropping && _write - _tail >= TC_LOG_BUFFER_SIZE) {
+    _dropping = true;
+    _write = _head;                     // take back what there is of this line
+  }
+  if (_dropping) {
+    if (b == '\n') {
+      _dropping = false;
+      _dropped++;
+    }
+    return 1;
+  }
+  _buffer[_write & (TC_LOG_BUFFER_SIZE - 1)] = b;
+  _write++;
+  if (b == '\n')
+    _head = _write;
+  return 1;
+}
+
+size_t TactileLog::write(const uint8_t *buffer, size_t size) {
+  for (size_t i = 0; i < size; i++)
+    write(buffer[i]);
+  return size;
+}
+
+bool TactileLog::drain() {
+  if (_dropped != _droppedReported && _tail == _head && _write == _head) {
+    uint32_t lost = _dropped - _droppedReported;
+    _droppedReported = _dropped;
+    print("TactileLog: lines dropped: ");
+    println(lost);
+  }
+  uint32_t head = _head;
+  uint32_t tail = _tail;
+  while (tail != head) {
+    int room = Serial.availableForWrite();
+    if (room <= 0)
+      break;
+    uint32_t n = head - tail;
+    uint32_t untilEnd = TC_LOG_BUFFER_SIZE - (tail & (TC_LOG_BUFFER_SIZE - 1));
+    if (n > untilEnd)
+      n = untilEnd;
+    if (n > (uint32_t)room)
+      n = room;
+    Serial.write((const uint8_t *)&_buffer[tail & (TC_LOG_BUFFER_SIZE - 1)], n);
+    tail += n;
+  }
+  _tail = tail;
+  return tail != _head;
+}
 
 TactileCPU* TactileCPU::setup() {
-  TactileCPU* tcpu = new(TactileCPU);
+  TactileCPU* tcpu = new(tactileStorage<TactileCPU>()) TactileCPU;
   //  pinMode(TC_LED_PIN, OUTPUT);    // declare the TC_LED_PIN as an OUTPUT:
   Serial.begin(57600);
-  tcpu->_logLevel = 1;
+  tcpu->_logLevel = 0;
+  tcpu->setLogLevel(1);
+  tcpu->_sleepMicros = 0;
   return tcpu;
 }
 
@@ -34,47 +116,36 @@ TactileCPU* TactileCPU::setup() {
  ----------------------------------------------------------------------*/
 
 void TactileCPU::setLogLevel(int level) {
+  int wanted = level;
+  if (level > TACTILE_MAX_LOG_LEVEL)
+    level = TACTILE_MAX_LOG_LEVEL;
+  if (level < 0)
+    level = 0;
   _logLevel = level;
+  if (wanted > level)
+    logAction("TactileCPU: log level limited to TACTILE_MAX_LOG_LEVEL: ", level);
 }
 
-int TactileCPU::getLogLevel() {
-  return _logLevel;
-}
-
-void TactileCPU::log(const char *msg) {
-  if (_logLevel < 1) return;
-  if (msg == NULL)
-    Serial.println("TactileCUP::log: NULL message!");
-  else
-    Serial.println(msg);
-}
-
-void TactileCPU::logAction(const char *msg, int track) {
-  if (_logLevel < 1) return;
-  if (msg == NULL)
-    Serial.println("TactileCPU::logAction: NULL message!");
-  else {
-    Serial.print(msg);
-    Serial.println(track);
-  }
-}
+// The level has been checked (see TactileCPU.h)
 
-void TactileCPU::log2(const char *msg) {
-  if (_logLevel < 2) return;
+void TactileCPU::_log(const char *msg) {
+  PROFILE_NESTED_BEGIN();
   if (msg == NULL)
-    Serial.println("TactileCPU::log2: NULL message!");
+    tactileLog.println("TactileCPU::log: NULL message!");
   else
-    Serial.println(msg);
+    tactileLog.println(msg);
+  PROFILE_NESTED_END(PROFILE_LOGGING);
 }
 
-void TactileCPU::logAction2(const char *msg, int track) {
-  if (_logLevel < 2) return;
+void TactileCPU::_logAction(const char *msg, int track) {
+  PROFILE_NESTED_BEGIN();
   if (msg == NULL)
-    Serial.println("TactileCPU::logAction2: NULL message!");
+    tactileLog.println("TactileCPU::logAction: NULL message!");
   else {
-    Serial.print(msg);
-    Serial.println(track);
+    tactileLog.print(msg);
+    tactileLog.println(track);
   }
+  PROFILE_NESTED_END(PROFILE_LOGGING);
 }
 
 void TactileCPU::turnLedOn() {
@@ -88,3 +159,41 @@ void TactileCPU::turnLedOff() {
 void TactileCPU::sleep(int milliseconds) {
   delay(milliseconds);
 }
+
+// Stops the CPU until the next interrupt (at least every millisecond,
+// from the system timer; more often from the audio system and USB).
+
+void TactileCPU::waitForInterrupt() {
+  uint32_t start = micros();
+  asm volatile("wfi");
+  _sleepMicros += micros() - start;
+}
+
+uint32_t TactileCPU::getSleepMicros() {
+  return _sleepMicros;
+}
+
+/*----------------------------------------------------------------------
+ * Clock speed and power. The audio system, USB and millis()/micros()
+ * all have their own clocks, so they carry on normally at any speed;
+ * only the code itself runs slower.
+ ----------------------------------------------------------------------*/
+
+void TactileCPU::setClockSpeed(uint32_t hz) {
+  if (hz == F_CPU_ACTUAL)
+    return;
+  set_arm_clock(hz);
+  logAction2("TactileCPU: clock speed (MHz): ", F_CPU_ACTUAL / 1000000);
+}
+
+uint32_t TactileCPU::getClockSpeed() {
+  return F_CPU_ACTUAL;
+}
+
+float TactileCPU::estimateCurrent(float awakeFraction) {
+  if (awakeFraction < 0.0)
+    awakeFraction = 0.0;
+  else if (awakeFraction > 1.0)
+    awakeFraction = 1.0;
+  return TC_SLEEP_MA + awakeFraction * TC_RUN_MA_PER_MHZ * (F_CPU_ACTUAL / 1000000.0);
+}
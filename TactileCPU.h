@@ -21,27 +21,97 @@
 #ifndef TactileCPU_h
 #define TactileCPU_h 1
 
+#include <Arduino.h>
 #include "TactileBasics.h"
 
 // Hardware-specific Teensy 4.1 definitions
 #define TC_LED_PIN 13
 
+// Clock speeds, and rough figures for the board's current (5V supply),
+// for estimating power use; they aren't measurements.
+#define TC_FULL_CLOCK_HZ   F_CPU
+#define TC_IDLE_CLOCK_HZ   24000000     // the slowest the clock goes
+#define TC_SLEEP_MA        20.0         // waiting for an interrupt
+#define TC_RUN_MA_PER_MHZ  0.13         // more while running: about 100 mA in all at 600 MHz
+
+/*----------------------------------------------------------------------
+ * The log. Everything printed for the serial monitor goes through
+ * tactileLog (it's a Print, so tactileLog.print() etc. work just like
+ * Serial's), which keeps it in a ring buffer. drain() sends what the USB
+ * serial port can take without waiting, once per pass of the loop, so
+ * logging never holds up the sensors or audio. Lines are kept whole: if
+ * there's no room for one, it's dropped, and counted; a note of how many
+ * were lost is logged once there's room again.
+ *
+ * Only the sending is put off: the text is formatted (numbers turned
+ * into digits, etc.) by the caller, as it's printed, and what's buffered
+ * is the finished text. Messages are often built from names in buffers
+ * that won't last (e.g. a file path on the stack), so they couldn't be
+ * kept as a format and its arguments anyway.
+ *
+ * Until setAsync(true) (at the end of Tactile::setup()) it goes straight
+ * to Serial instead, so nothing is lost while starting up.
+ ----------------------------------------------------------------------*/
+
+#define TC_LOG_BUFFER_SIZE  4096        // bytes, a power of 2
+
+// The highest log level that's compiled in. Logging above it is removed
+// entirely (the level tests are constant, so the compiler drops the
+// calls and any "if (getLogLevel() > 1)" blocks); setLogLevel() can only
+// choose up to it. For a production build with no logging code at all,
+// compile with -DTACTILE_MAX_LOG_LEVEL=0 (or change it here).
+#ifndef TACTILE_MAX_LOG_LEVEL
+#define TACTILE_MAX_LOG_LEVEL 2
+#endif
+
+class TactileLog : public Print {
+ public:
+  TactileLog();
+  virtual size_t write(uint8_t b);
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  using Print::write;
+
+  void     setAsync(bool on);
+  bool     drain();                     // true if there's more to send
+  uint32_t getDropped() { return _dropped; }    // lines, in all
+
+ private:
+  char              _buffer[TC_LOG_BUFFER_SIZE];
+  volatile uint32_t _head;              // end of the last whole line; only the writer moves it
+  volatile uint32_t _tail;              // next to send; only drain() moves it
+  uint32_t          _write;             // end of the line being written
+  bool              _dropping;          // no room: the rest of this line is thrown away
+  uint32_t          _dropped;
+  uint32_t          _droppedReported;
+  bool              _async;
+};
+
+extern TactileLog tactileLog;
+
 class TactileCPU {
  public:
 
   static TactileCPU *setup();
   void turnLedOn();
   void turnLedOff();
-  void setLogLevel(int level);
-  int  getLogLevel();
-  void log(const char *msg);
-  void log2(const char *msg);
-  void logAction(const char *msg, int track);
-  void logAction2(const char *msg, int track);
+  void setLogLevel(int level);          // 0 to TACTILE_MAX_LOG_LEVEL
+  int  getLogLevel() { return _logLevel < TACTILE_MAX_LOG_LEVEL ? _logLevel : TACTILE_MAX_LOG_LEVEL; }
+  void log(const char *msg)                   { if (TACTILE_MAX_LOG_LEVEL >= 1 && _logLevel >= 1) _log(msg); }
+  void log2(const char *msg)                  { if (TACTILE_MAX_LOG_LEVEL >= 2 && _logLevel >= 2) _log(msg); }
+  void logAction(const char *msg, int track)  { if (TACTILE_MAX_LOG_LEVEL >= 1 && _logLevel >= 1) _logAction(msg, track); }
+  void logAction2(const char *msg, int track) { if (TACTILE_MAX_LOG_LEVEL >= 2 && _logLevel >= 2) _logAction(msg, track); }
   void sleep(int milliseconds);
+  void waitForInterrupt();
+  uint32_t getSleepMicros();            // time spent in waitForInterrupt(), in all
+  void     setClockSpeed(uint32_t hz);
+  uint32_t getClockSpeed();
+  float    estimateCurrent(float awakeFraction);  // mA, at the current clock speed
 
  private:
-  int _logLevel;
+  void _log(const char *msg);
+  void _logAction(const char *msg, int track);
+  int _logLevel;                        // never more than TACTILE_MAX_LOG_LEVEL
+  uint32_t _sleepMicros;
 };
 
 #endif
@@ -18,9 +18,79 @@
 +======================================================================
 */
 
+#include <Audio.h>
+#include <algorithm>
+
 #include "TactileCPU.h"
 #include "TactileFileManager.h"
 
+// A directory's catalog file: a header, then each file's name (length
+// byte, then the characters), size, modification time, leading silence,
+// .WAV info, loudness and peak. The checksum covers the files.
+struct TactileCatalogHeader {
+  char     magic[4];                    // "TCAT"
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t key;                         // the directory's key when it was read
+  uint32_t numFiles;
+  uint32_t checksum;
+};
+
+// FNV-1a hash
+static uint32_t hashBytes(uint32_t hash, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+#define HASH_INIT 2166136261UL
+
+// Steps of refreshing a directory after an SD card goes in (_refreshSlice())
+#define REFRESH_OPEN   0                // open it
+#define REFRESH_HASH   1                // hashing its entries, then checking its key
+#define REFRESH_READ   2                // reading its .WAV files
+#define REFRESH_WAV    3                // reading the new files' headers
+
+// Is this a file the catalog should have?
+static bool isEligible(const char *name, int len, bool isDir) {
+  return !(   len >= MAX_FILE_NAME
+           || len < 5
+           || isDir
+           || name[0] == '_'
+           || name[0] == '.'
+           || (strcmp(name + len - 4, ".WAV") != 0 && strcmp(name + len - 4, ".wav") != 0));
+}
+
+// A file's modification time, packed into 32 bits (0 if it doesn't have one)
+static uint32_t fileTime(File *file) {
+  DateTimeFields tm;
+  if (!file->getModifyTime(tm))
+    return 0;
+  return ((uint32_t)tm.year << 26) | ((uint32_t)tm.mon << 22) | ((uint32_t)tm.mday << 17)
+       | ((uint32_t)tm.hour << 12) | ((uint32_t)tm.min << 6) | tm.sec;
+}
+
+// Adds a directory entry to a hash (see _hashDir()). Our own files (names
+// starting with '_') are left out, since they change all the time, and
+// so are subdirectories' sizes and times.
+static uint32_t hashEntry(uint32_t hash, File *file) {
+  const char *name = file->name();
+  if (name[0] == '_')
+    return hash;
+  bool isDir = file->isDirectory();
+  uint32_t size = isDir ? 0 : file->size();
+  uint32_t mtime = isDir ? 0 : fileTime(file);
+  hash = hashBytes(hash, name, strlen(name) + 1);
+  hash = hashBytes(hash, &size, sizeof(size));
+  return hashBytes(hash, &mtime, sizeof(mtime));
+}
+
+// Candidates for the default flash tier (see useDefaultFlashTier())
+static LittleFS_QSPIFlash qspiFlash;
+static LittleFS_Program   programFlash;
+
 TactileFileManager::TactileFileManager(TactileCPU *tc) {
   _tc = tc;
 
@@ -33,140 +103,506 @@ TactileFileManager::TactileFileManager(TactileCPU *tc) {
   SPI.setMOSI(SDCARD_MOSI_PIN);
   SPI.setSCK(SDCARD_SCK_PIN);
   if (!SD.begin(SDCARD_CS_PIN)) {
-    Serial.println("SD card initialization failed!");  // always print, even of logging turned off.
+    tactileLog.println("SD card initialization failed!");  // always print, even of logging turned off.
     while (1);
   }
   _tc->log2("SD card initialization done.");
-  _tc->log2("TactileFileManager: Reading filenames...");
 
-  for (int i = 0; i < NUM_TRACKS; i++)
-    _fileNames[i][0] = 0;
-  for (int i = 0; i < NUM_SUBDIRS; i++) {
-    _numSubDirFiles[i] = 0;
-    for (int j = 0; j < NUM_TRACKS_IN_SUBDIR; j++)
-      _subDirFileNames[i][j][0] = 0;
+  _names = NULL;
+  _namesUsed = 0;
+  _namesSize = 0;
+  _addName("", 0);                      // offset 0: the empty name
+  _files = NULL;
+  _numFiles = 0;
+  _filesSize = 0;
+  _dirs = NULL;
+  _numDirs = 0;
+  _dirsSize = 0;
+  _silenceScan = false;
+  _loudnessScan = false;
+  _scanIndex = 0;
+  _flash = NULL;
+  _copyPending = false;
+  _copyIndex = 0;
+  _cardPresent = true;
+  _lastCardCheck = millis();
+  _refreshDir = -1;
+  _refreshStep = REFRESH_OPEN;
+  _refreshKey = 0;
+  _refreshFirst = 0;
+  _refreshPos = 0;
+  _compactPending = false;
+
+  // The root directory holds the tracks; other directories are read
+  // when they're first used.
+  _addDir("/");
+  _loadDir(ROOT_DIR);
+
+  // When detailed logging enabled...
+  if (_tc->getLogLevel() > 0) {
+    tactileLog.println("TactileFileManager:: tracks found:");
+    for (int i = 0; i < NUM_TRACKS; i++) {
+      const char *name = getFileName(i);
+      if (name && name[0])
+        tactileLog.println(name);
+    }
   }
-  _tc->log2("Name arrays initialized");
+}
 
-  // Find WAV files in the root directory
-  File dir = SD.open("/");
-  _readDirIntoStringArray(&dir, -1);
-  dir.close();
+/*----------------------------------------------------------------------
+ * The catalog
+ ----------------------------------------------------------------------*/
+
+// Adds a name to the arena, returns its offset. The arena grows as
+// needed; if there's no memory, the name is replaced by "". Note that
+// growing the arena can move it, so name pointers are only good until
+// the next directory is read.
 
-  // Find WAV files in the subdirectories E1-E4
-  char dirName[3] = "Ex";
-  for (int dirNum = 1; dirNum <= NUM_SUBDIRS; dirNum++) {
-    dirName[1] = '0'+dirNum;
-    dir = SD.open(dirName);
-    if (dir) {
-      _numSubDirFiles[dirNum-1] = _readDirIntoStringArray(&dir, dirNum-1);
-    } else if (_tc->getLogLevel() > 1) {
-      Serial.print("TactileFileManager: Failed to open directory: '");
-      Serial.print(dirName);
-      Serial.println("'");
+uint32_t TactileFileManager::_addName(const char *name, int len) {
+  if (_namesUsed + len + 1 > _namesSize) {
+    uint32_t newSize = _namesSize + NAME_ARENA_CHUNK;
+    while (_namesUsed + len + 1 > newSize)
+      newSize += NAME_ARENA_CHUNK;
+    char *names = (char *)realloc(_names, newSize);
+    if (!names) {
+      _tc->log("TactileFileManager: ERROR: out of memory for file names");
+      return 0;
     }
+    _names = names;
+    _namesSize = newSize;
   }
+  uint32_t offset = _namesUsed;
+  memcpy(_names + offset, name, len);
+  _names[offset + len] = 0;
+  _namesUsed += len + 1;
+  return offset;
+}
 
-  // When detailed logging enabled...
-  if (_tc->getLogLevel() > 0) {
-    Serial.println("TactileFileManager:: tracks found:");
-    for (int i = 0; i < NUM_TRACKS; i++) {
-      if (_fileNames[i])
-        Serial.println(_fileNames[i]);
-    }
-    for (int i = 0; i < NUM_SUBDIRS; i++) {
-      Serial.print("E");
-      Serial.print(i+1);
-      Serial.println("/");
-      for (int j = 0; j < NUM_TRACKS_IN_SUBDIR; j++) {
-        char *name = _subDirFileNames[i][j];
-        if (name && strlen(name) > 0) {
-          Serial.print("    ");
-          Serial.println(name);
-        }
-      }
+int TactileFileManager::_addDir(const char *path) {
+  if (_numDirs >= _dirsSize) {
+    TactileDir *dirs = (TactileDir *)realloc(_dirs, (_dirsSize + CATALOG_CHUNK) * sizeof(TactileDir));
+    if (!dirs) {
+      _tc->log("TactileFileManager: ERROR: out of memory for directories");
+      return -1;
     }
+    _dirs = dirs;
+    _dirsSize += CATALOG_CHUNK;
   }
+  TactileDir *d = &_dirs[_numDirs];
+  d->path      = _addName(path, strlen(path));
+  d->key       = 0;
+  d->firstFile = 0;
+  d->numFiles  = 0;
+  d->loaded    = false;
+  d->changed   = false;
+  return _numDirs++;
 }
 
-int TactileFileManager::_readDirIntoStringArray(File *dir, int subDirNum)
-{
-  char tmpNames[NUM_TRACKS_IN_SUBDIR][MAX_FILE_NAME];
+// Adds a file to the end of the file table, which must be the directory
+// being read. The caller sets the directory's numFiles when it's done.
+
+TactileFileEntry *TactileFileManager::_addFile(int dirNum, const char *name, int len, uint32_t size, uint32_t mtime) {
+  if (_numFiles >= _filesSize) {
+    TactileFileEntry *files = (TactileFileEntry *)realloc(_files, (_filesSize + CATALOG_CHUNK) * sizeof(TactileFileEntry));
+    if (!files) {
+      _tc->log("TactileFileManager: ERROR: out of memory for the catalog");
+      return NULL;
+    }
+    _files = files;
+    _filesSize += CATALOG_CHUNK;
+  }
+  TactileFileEntry *entry = &_files[_numFiles++];
+  memset(entry, 0, sizeof(*entry));
+  entry->name    = _addName(name, len);
+  entry->size    = size;
+  entry->mtime   = mtime;
+  entry->silence = SILENCE_UNKNOWN;
+  entry->loudness = LOUDNESS_UNKNOWN;
+  entry->dir     = dirNum;
+  return entry;
+}
+
+uint32_t TactileFileManager::getCatalogBytes() {
+  return _namesSize + _filesSize * sizeof(TactileFileEntry) + _dirsSize * sizeof(TactileDir);
+}
+
+TactileFileEntry *TactileFileManager::_entry(int dirNum, int fileNum) {
+  if (dirNum < 0 || dirNum >= _numDirs)
+    return NULL;
+  if (!_dirs[dirNum].loaded)
+    _loadDir(dirNum);
+  if (fileNum < 0 || fileNum >= _dirs[dirNum].numFiles)
+    return NULL;
+  return &_files[_dirs[dirNum].firstFile + fileNum];
+}
+
+void TactileFileManager::_makePath(char *path, const TactileFileEntry *entry) {
+  strcpy(path, _dirPath(entry->dir));
+  if (entry->dir != ROOT_DIR)
+    strcat(path, "/");
+  strcat(path, _nameOf(entry));
+}
+
+// Reads a directory's files into the catalog: from its catalog file if
+// that's up to date, otherwise from the directory itself. The SD card
+// is shared with the players, so each SD card operation is done with the
+// audio interrupt off, but only that operation: reading a big directory
+// takes a long time, and tracks that are playing meanwhile keep playing.
+
+void TactileFileManager::_loadDir(int dirNum) {
+  const char *path = _dirPath(dirNum);  // (until names are added)
+
+  // A refresh that's reading a directory needs the end of the file
+  // table to itself; it starts that directory again afterwards.
+  if (_refreshDir >= 0 && _refreshStep >= REFRESH_READ)
+    _cancelRefreshDir();
+
+  _dirs[dirNum].loaded    = true;
+  _dirs[dirNum].firstFile = _numFiles;
+  _dirs[dirNum].numFiles  = 0;
+
+  AudioNoInterrupts();
+  File dir = SD.open(path);
+  AudioInterrupts();
+  if (!dir) {
+    _tc->log("TactileFileManager: Failed to open directory:");
+    _tc->log(path);
+    return;
+  }
+  _dirs[dirNum].key = _dirKey(&dir);
+  AudioNoInterrupts();
+  dir.close();
+  AudioInterrupts();
 
+  if (_readCatalog(dirNum, _dirs[dirNum].key)) {
+    _tc->log2("TactileFileManager: catalog is up to date:");
+    _tc->log2(_dirPath(dirNum));
+  } else {
+    _tc->log2("TactileFileManager: Reading filenames:");
+    _tc->log2(_dirPath(dirNum));
+    AudioNoInterrupts();
+    dir = SD.open(_dirPath(dirNum));
+    AudioInterrupts();
+    _readDir(&dir, dirNum);
+    AudioNoInterrupts();
+    dir.close();
+    AudioInterrupts();
+    _readWavInfo(dirNum);
+    _writeCatalog(dirNum);
+  }
+
+  if (_flash)
+    _scanFlashDir(dirNum);
+
+  if (_tc->getLogLevel() > 1) {
+    tactileLog.print(_dirPath(dirNum));
+    tactileLog.print(": ");
+    tactileLog.print(_dirs[dirNum].numFiles);
+    tactileLog.println(" files");
+  }
+}
+
+// Reads a directory's .WAV files into the catalog, sorted by name.
+
+void TactileFileManager::_readDir(File *dir, int dirNum)
+{
   if (_tc->getLogLevel() > 1) {
-    Serial.print("TactileFileManager::_readDirIntoStringArray(");
+    tactileLog.print("TactileFileManager::_readDir(");
     if (!dir)
-      Serial.print("NULL-dir");
+      tactileLog.print("NULL-dir");
     else
-      Serial.print(dir->name());
-    Serial.print(", ");
-    Serial.print(subDirNum);
-    Serial.println(")");
+      tactileLog.print(dir->name());
+    tactileLog.print(", ");
+    tactileLog.print(dirNum);
+    tactileLog.println(")");
   }
 
-  // Read the directory, copy "eligible" filenames (.WAV) to a temporary array
+  // Read the directory, add "eligible" filenames (.WAV) to the catalog
   File file;
-  int numFiles = 0;
-  char name[MAX_FILE_NAME+1];
-  while (file = dir->openNextFile()) {
-    strncpy(name, file.name(), MAX_FILE_NAME);
-    int len = strlen(file.name());
-    bool isDir = file.isDirectory();
-    _tc->logAction2(name, isDir);
-    file.close();
-    if (len > MAX_FILE_NAME)
-      continue;
-    if (isDir)
-      continue;
-    if (   name[0] == '_'
-        || name[0] == '.'
-        || (strcmp(name + len - 4, ".WAV") != 0 && strcmp(name + len - 4, ".wav") != 0))
-      continue;
-    strcpy(tmpNames[numFiles], name);
-    numFiles++;
-    if (numFiles >= NUM_TRACKS_IN_SUBDIR) {
-      _tc->logAction("TactileFileManager: WARNING: too many files in this directory: ", NUM_TRACKS_IN_SUBDIR);
-      break;
+  bool more = true;                     // (file is false once it's closed)
+  bool full = false;
+  while (more && !full) {
+    AudioNoInterrupts();
+    file = dir->openNextFile();
+    more = file;
+    if (more) {
+      const char *name = file.name();
+      int len = strlen(name);
+      bool isDir = file.isDirectory();
+      _tc->logAction2(name, isDir);
+      if (isEligible(name, len, isDir))
+        full = !_addFile(dirNum, name, len, file.size(), fileTime(&file));
+      file.close();
     }
+    AudioInterrupts();
   }
+  _dirs[dirNum].numFiles = _numFiles - _dirs[dirNum].firstFile;
 
-  // Now copy to the destination in sorted order (uses a trivial N^2 sort).
-  int destFileNum = 0;
-  char minName[MAX_FILE_NAME+1];
-  while (1) {
+  const char *names = _names;
+  TactileFileEntry *first = &_files[_dirs[dirNum].firstFile];
+  std::sort(first, first + _dirs[dirNum].numFiles, [names](const TactileFileEntry &a, const TactileFileEntry &b) {
+    return strcmp(names + a.name, names + b.name) < 0;
+  });
+}
 
-    // Scan the list of names, find the lowest one.
-    minName[0] = 0;
-    int minNameIndex = -1;
-    for (int fileNum = 0; fileNum < numFiles; fileNum++) {
-      if (strlen(tmpNames[fileNum]) > 0 && (strlen(minName) == 0 || strcmp(tmpNames[fileNum], minName) < 0)) {
-        strcpy(minName, tmpNames[fileNum]);
-        minNameIndex = fileNum;
-        Serial.print("TactileFileManager: minName: ");
-        Serial.print(minName);
-        Serial.print(", ");
-        Serial.println(fileNum);
-      }
+// Reads the header of every file in a directory (only done when the
+// directory is read, not when its catalog file is used).
+
+void TactileFileManager::_readWavInfo(int dirNum) {
+  for (int fileNum = 0; fileNum < _dirs[dirNum].numFiles; fileNum++)
+    _readWavHeader(&_files[_dirs[dirNum].firstFile + fileNum]);
+}
+
+// Reads one file's header, and complains if it isn't something the
+// player can play.
+
+void TactileFileManager::_readWavHeader(TactileFileEntry *entry) {
+  char path[MAX_FILE_PATH + 1];
+  _makePath(path, entry);
+  AudioNoInterrupts();
+  File file = SD.open(path);
+  if (!file || !TactileWav::parseHeader(&file, &entry->info))
+    memset(&entry->info, 0, sizeof(entry->info));
+  file.close();
+  AudioInterrupts();
+  if (!TactileWav::isSupported(&entry->info)) {
+    _tc->log("TactileFileManager: can't play this file (must be 16-bit PCM, 44.1 kHz, mono or stereo):");
+    _tc->log(path);
+  }
+}
+
+// A hash of a directory's entries: names, sizes and modification times.
+
+uint32_t TactileFileManager::_hashDir(File *dir) {
+  uint32_t hash = HASH_INIT;
+  File file;
+  bool more = true;                     // (file is false once it's closed)
+  while (more) {
+    AudioNoInterrupts();
+    file = dir->openNextFile();
+    more = file;
+    if (more) {
+      hash = hashEntry(hash, &file);
+      file.close();
     }
+    AudioInterrupts();
+  }
+  return hash;
+}
+
+// A key that changes when the directory's contents do, including a file
+// that's overwritten under the same name.
+
+uint32_t TactileFileManager::_dirKey(File *dir) {
+  return _hashDir(dir) | 1;             // never 0
+}
 
-    // No names left? All done.
-    if (minNameIndex == -1)
+static void catalogPath(char *path, const char *dirPath) {
+  strcpy(path, dirPath);
+  if (strcmp(dirPath, "/") != 0)
+    strcat(path, "/");
+  strcat(path, CATALOG_FILE);
+}
+
+bool TactileFileManager::_readCatalog(int dirNum, uint32_t key) {
+  char path[MAX_DIR_PATH + sizeof(CATALOG_FILE) + 2];
+  catalogPath(path, _dirPath(dirNum));
+  AudioNoInterrupts();
+  File f = SD.open(path);
+  AudioInterrupts();
+  if (!f)
+    return false;
+
+  TactileCatalogHeader header;
+  AudioNoInterrupts();
+  bool ok = f.read(&header, sizeof(header)) == sizeof(header);
+  AudioInterrupts();
+  ok = ok
+    && memcmp(header.magic, "TCAT", 4) == 0
+    && header.version == CATALOG_VERSION
+    && header.key == key;
+
+  uint32_t namesUsed = _namesUsed;
+  uint32_t checksum = HASH_INIT;
+  char name[MAX_FILE_NAME];
+  for (uint32_t i = 0; ok && i < header.numFiles; i++) {
+    uint8_t len;
+    uint32_t size, mtime, silence;
+    TactileWavInfo info;
+    int16_t loudness;
+    uint16_t peak;
+    AudioNoInterrupts();
+    ok = f.read(&len, 1) == 1
+      && len < MAX_FILE_NAME
+      && f.read(name, len) == len
+      && f.read(&size, sizeof(size)) == sizeof(size)
+      && f.read(&mtime, sizeof(mtime)) == sizeof(mtime)
+      && f.read(&silence, sizeof(silence)) == sizeof(silence)
+      && f.read(&info, sizeof(info)) == sizeof(info)
+      && f.read(&loudness, sizeof(loudness)) == sizeof(loudness)
+      && f.read(&peak, sizeof(peak)) == sizeof(peak);
+    AudioInterrupts();
+    if (!ok)
+      break;
+    TactileFileEntry *entry = _addFile(dirNum, name, len, size, mtime);
+    if (!entry) {
+      ok = false;
       break;
+    }
+    entry->silence = silence;
+    entry->info = info;
+    entry->loudness = loudness;
+    entry->peak = peak;
+    checksum = hashBytes(checksum, &len, 1);
+    checksum = hashBytes(checksum, name, len);
+    checksum = hashBytes(checksum, &size, sizeof(size));
+    checksum = hashBytes(checksum, &mtime, sizeof(mtime));
+    checksum = hashBytes(checksum, &silence, sizeof(silence));
+    checksum = hashBytes(checksum, &info, sizeof(info));
+    checksum = hashBytes(checksum, &loudness, sizeof(loudness));
+    checksum = hashBytes(checksum, &peak, sizeof(peak));
+  }
+  AudioNoInterrupts();
+  f.close();
+  AudioInterrupts();
 
-    // Found the lowest name, copy to destination
-    if (subDirNum < 0)
-      strcpy(_fileNames[destFileNum], minName);
-    else
-      strcpy(_subDirFileNames[subDirNum][destFileNum], minName);
-    destFileNum++;
+  if (ok && checksum == header.checksum) {
+    _dirs[dirNum].numFiles = _numFiles - _dirs[dirNum].firstFile;
+    return true;
+  }
+
+  // Forget whatever was read
+  _tc->log2("TactileFileManager: catalog is out of date");
+  _numFiles = _dirs[dirNum].firstFile;
+  _dirs[dirNum].numFiles = 0;
+  _namesUsed = namesUsed;
+  return false;
+}
+
+// Writes a directory's catalog file, with the audio interrupt off for
+// each SD card operation.
+
+void TactileFileManager::_writeCatalog(int dirNum) {
+  TactileDir *d = &_dirs[dirNum];
+  TactileCatalogHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "TCAT", 4);
+  header.version = CATALOG_VERSION;
+  header.key = d->key;
+  header.numFiles = d->numFiles;
+
+  char path[MAX_DIR_PATH + sizeof(CATALOG_FILE) + 2];
+  catalogPath(path, _dirPath(dirNum));
+  AudioNoInterrupts();
+  SD.remove(path);
+  File f = SD.open(path, FILE_WRITE);
+  AudioInterrupts();
+  if (!f) {
+    _tc->log("TactileFileManager: can't write the catalog");
+    return;
+  }
+  AudioNoInterrupts();
+  f.write(&header, sizeof(header));     // checksum filled in below
+  AudioInterrupts();
+
+  uint32_t checksum = HASH_INIT;
+  bool ok = true;
+  for (int fileNum = 0; fileNum < d->numFiles; fileNum++) {
+    const TactileFileEntry *entry = &_files[d->firstFile + fileNum];
+    const char *name = _nameOf(entry);
+    uint8_t len = strlen(name);
+    AudioNoInterrupts();
+    ok = ok && f.write(&len, 1) == 1
+            && f.write(name, len) == len
+            && f.write(&entry->size, sizeof(entry->size)) == sizeof(entry->size)
+            && f.write(&entry->mtime, sizeof(entry->mtime)) == sizeof(entry->mtime)
+            && f.write(&entry->silence, sizeof(entry->silence)) == sizeof(entry->silence)
+            && f.write(&entry->info, sizeof(entry->info)) == sizeof(entry->info)
+            && f.write(&entry->loudness, sizeof(entry->loudness)) == sizeof(entry->loudness)
+            && f.write(&entry->peak, sizeof(entry->peak)) == sizeof(entry->peak);
+    AudioInterrupts();
+    checksum = hashBytes(checksum, &len, 1);
+    checksum = hashBytes(checksum, name, len);
+    checksum = hashBytes(checksum, &entry->size, sizeof(entry->size));
+    checksum = hashBytes(checksum, &entry->mtime, sizeof(entry->mtime));
+    checksum = hashBytes(checksum, &entry->silence, sizeof(entry->silence));
+    checksum = hashBytes(checksum, &entry->info, sizeof(entry->info));
+    checksum = hashBytes(checksum, &entry->loudness, sizeof(entry->loudness));
+    checksum = hashBytes(checksum, &entry->peak, sizeof(entry->peak));
+  }
+  header.checksum = checksum;
+  AudioNoInterrupts();
+  f.seek(0);
+  ok = ok && f.write(&header, sizeof(header)) == sizeof(header);
+  f.close();
+  if (!ok)
+    SD.remove(path);
+  AudioInterrupts();
+  if (!ok)
+    _tc->log("TactileFileManager: can't write the catalog");
+  d->changed = false;
+}
+
+// Finds a file by name, size and modification time, returns its file
+// number or -1.
 
-    // Take it out of the list
-    tmpNames[minNameIndex][0] = 0;
+int TactileFileManager::_findFile(int dirNum, const char *name, uint32_t size, uint32_t mtime) {
+  for (int fileNum = 0; fileNum < _dirs[dirNum].numFiles; fileNum++) {
+    const TactileFileEntry *entry = &_files[_dirs[dirNum].firstFile + fileNum];
+    if (entry->size == size && entry->mtime == mtime && strcmp(_nameOf(entry), name) == 0)
+      return fileNum;
   }
+  return -1;
+}
+
+/*----------------------------------------------------------------------
+ * Directories and files
+ ----------------------------------------------------------------------*/
+
+int TactileFileManager::findDirectory(const char *path)
+{
+  // Tidy it up: "E1", "/E1" and "/E1/" are all "/E1"
+  char dirPath[MAX_DIR_PATH + 2];
+  if (!path || strlen(path) > MAX_DIR_PATH - 1) {
+    _tc->log("TactileFileManager: findDirectory(): bad directory name");
+    return -1;
+  }
+  if (path[0] == '/')
+    strcpy(dirPath, path);
+  else {
+    dirPath[0] = '/';
+    strcpy(dirPath + 1, path);
+  }
+  int len = strlen(dirPath);
+  if (len > 1 && dirPath[len - 1] == '/')
+    dirPath[len - 1] = 0;
 
-  return numFiles;
+  for (int dirNum = 0; dirNum < _numDirs; dirNum++) {
+    if (strcmp(_dirPath(dirNum), dirPath) == 0)
+      return dirNum;
+  }
+
+  AudioNoInterrupts();
+  File dir = SD.open(dirPath);
+  bool exists = dir && dir.isDirectory();
+  dir.close();
+  AudioInterrupts();
+  if (!exists) {
+    if (_tc->getLogLevel() > 1) {
+      tactileLog.print("TactileFileManager: no such directory: '");
+      tactileLog.print(dirPath);
+      tactileLog.println("'");
+    }
+    return -1;
+  }
+  return _addDir(dirPath);
 }
 
+const char *TactileFileManager::getDirectoryPath(int dirNum) {
+  if (dirNum < 0 || dirNum >= _numDirs)
+    return NULL;
+  return _dirPath(dirNum);
+}
 
 const char *TactileFileManager::getFileName(int fileNum)
 {
@@ -174,27 +610,817 @@ const char *TactileFileManager::getFileName(int fileNum)
     _tc->logAction("TactileFileManager: getFileName(fileNum): fileNum out of range", fileNum);
     return NULL;
   }
-  return _fileNames[fileNum];
+  TactileFileEntry *entry = _entry(ROOT_DIR, fileNum);
+  return entry ? _nameOf(entry) : "";
 }
 
 
 const char *TactileFileManager::getFileName(int dirNum, int fileNum)
 {
-  if (dirNum < 0 || dirNum >= NUM_SUBDIRS) {
-    _tc->logAction("TactileFileManager: getFileName(dirNum, fileNum): dirNum out of range: ", dirNum);
+  TactileFileEntry *entry = _entry(dirNum, fileNum);
+  if (!entry) {
+    _tc->logAction("TactileFileManager: getFileName(dirNum, fileNum): out of range: ", fileNum);
     return NULL;
   }
-  if (fileNum < 0 || fileNum >= _numSubDirFiles[dirNum]) {
-    _tc->logAction("TactileFileManager: getFileName(dirNum, fileNum): fileNum out of range: ", fileNum);
-    return NULL;
-  }
-  return _subDirFileNames[dirNum][fileNum];
+  return _nameOf(entry);
+}
+
+bool TactileFileManager::getFilePath(char *path, int dirNum, int fileNum) {
+  TactileFileEntry *entry = _entry(dirNum, fileNum);
+  if (!entry)
+    return false;
+  _makePath(path, entry);
+  return true;
 }
 
 int TactileFileManager::getNumFiles(int dirNum) {
-  if (dirNum < 0 || dirNum >= NUM_SUBDIRS) {
+  if (dirNum < 0 || dirNum >= _numDirs) {
     _tc->log("TactileFileManager: getNumFiles(): dirNum out of range");
     return -1;
   }
-  return _numSubDirFiles[dirNum];
+  if (!_dirs[dirNum].loaded)
+    _loadDir(dirNum);
+  return _dirs[dirNum].numFiles;
+}
+
+const TactileWavInfo *TactileFileManager::getWavInfo(int fileNum) {
+  return getWavInfo(ROOT_DIR, fileNum);
+}
+
+const TactileWavInfo *TactileFileManager::getWavInfo(int dirNum, int fileNum) {
+  TactileFileEntry *entry = _entry(dirNum, fileNum);
+  return entry ? &entry->info : NULL;
+}
+
+static uint32_t wavDuration(const TactileWavInfo *info) {
+  if (!info || info->blockAlign == 0 || info->sampleRate == 0)
+    return 0;
+  return (uint32_t)((uint64_t)(info->dataLength / info->blockAlign) * 1000 / info->sampleRate);
+}
+
+uint32_t TactileFileManager::getDuration(int fileNum) {
+  return wavDuration(getWavInfo(fileNum));
+}
+
+uint32_t TactileFileManager::getDuration(int dirNum, int fileNum) {
+  return wavDuration(getWavInfo(dirNum, fileNum));
+}
+
+bool TactileFileManager::isPlayable(int fileNum) {
+  return isPlayable(ROOT_DIR, fileNum);
+}
+
+bool TactileFileManager::isPlayable(int dirNum, int fileNum) {
+  const TactileWavInfo *info = getWavInfo(dirNum, fileNum);
+  return info && TactileWav::isSupported(info);
+}
+
+/*----------------------------------------------------------------------
+ * Leading silence and loudness
+ ----------------------------------------------------------------------*/
+
+uint32_t TactileFileManager::getLeadingSilence(int fileNum) {
+  return getLeadingSilence(ROOT_DIR, fileNum);
+}
+
+uint32_t TactileFileManager::getLeadingSilence(int dirNum, int fileNum) {
+  TactileFileEntry *entry = _entry(dirNum, fileNum);
+  if (!entry || entry->silence == SILENCE_UNKNOWN)
+    return 0;
+  return entry->silence;
+}
+
+void TactileFileManager::setSilenceScan(bool on) {
+  _silenceScan = on;
+  _tc->logAction2("TactileFileManager: setSilenceScan: ", on);
+}
+
+float TactileFileManager::getNormalizeGain(int fileNum) {
+  return getNormalizeGain(ROOT_DIR, fileNum);
+}
+
+// The gain that brings the file to NORMALIZE_TARGET, but no more than
+// NORMALIZE_MAX_BOOST, and not so much that its peak would clip.
+
+float TactileFileManager::getNormalizeGain(int dirNum, int fileNum) {
+  TactileFileEntry *entry = _entry(dirNum, fileNum);
+  if (!entry || entry->loudness == LOUDNESS_UNKNOWN || entry->loudness <= LOUDNESS_SILENT)
+    return 1.0f;
+  float dB = (NORMALIZE_TARGET - entry->loudness) / 100.0f;
+  if (dB > NORMALIZE_MAX_BOOST)
+    dB = NORMALIZE_MAX_BOOST;
+  float gain = powf(10.0f, dB / 20.0f);
+  if (entry->peak > 0 && gain * entry->peak > 32767.0f)
+    gain = 32767.0f / entry->peak;
+  return gain;
+}
+
+void TactileFileManager::setLoudnessScan(bool on) {
+  _loudnessScan = on;
+  _scanIndex = 0;                       // files skipped before need measuring now
+  _tc->logAction2("TactileFileManager: setLoudnessScan: ", on);
+}
+
+// Advances _scanIndex to the next file that hasn't been scanned. Returns
+// false when there aren't any more. (Directories read later add files at
+// the end, so they're scanned too.)
+
+bool TactileFileManager::_nextFileToScan() {
+  for ( ; _scanIndex < _numFiles; _scanIndex++) {
+    const TactileFileEntry *entry = &_files[_scanIndex];
+    if (   (_silenceScan && entry->silence == SILENCE_UNKNOWN)
+        || (_loudnessScan && entry->loudness == LOUDNESS_UNKNOWN))
+      return true;
+  }
+  return false;
+}
+
+void TactileFileManager::_finishScan() {
+  TactileFileEntry *entry = &_files[_scanIndex];
+  entry->silence = (_scanSilence == SILENCE_UNKNOWN) ? 0 : _scanSilence;
+  if (_scanLoudness) {
+    entry->loudness = _meter.loudness();
+    entry->peak = _meter.peak();
+  } else if (entry->loudness == LOUDNESS_UNKNOWN && !TactileWav::isSupported(&_scanInfo)) {
+    entry->loudness = LOUDNESS_SILENT;  // (can't be played anyway)
+  }
+  _dirs[entry->dir].changed = true;
+  AudioNoInterrupts();
+  _scanFile.close();
+  AudioInterrupts();
+  if (_tc->getLogLevel() > 1) {
+    char path[MAX_FILE_PATH + 1];
+    _makePath(path, entry);
+    tactileLog.print("TactileFileManager: leading silence ");
+    tactileLog.print(entry->silence);
+    tactileLog.print(" bytes");
+    if (_scanLoudness) {
+      tactileLog.print(", loudness ");
+      tactileLog.print(entry->loudness / 100.0f);
+      tactileLog.print(" LUFS, peak ");
+      tactileLog.print(entry->peak);
+    }
+    tactileLog.print(": ");
+    tactileLog.println(path);
+  }
+  _scanIndex++;
+}
+
+// Does one small piece of background work: checking for the SD card,
+// a step of copying a clip to the flash tier, of refreshing the catalog
+// after a card went in, or of the leading-silence and loudness scan
+// (opening a file, or reading SILENCE_SCAN_CHUNK bytes of it), or saving a directory's
+// catalog after it changed. Called from the main loop.
+
+void TactileFileManager::doBackgroundTasks(bool audioIdle) {
+
+  if (millis() - _lastCardCheck >= CARD_CHECK_INTERVAL)
+    _checkCard();
+  if (!_cardPresent)
+    return;
+
+  // Copying to the flash tier comes first, but only while nothing is playing.
+  if (_flash && audioIdle && (_copySrc || _copyPending)) {
+    _copyStep();
+    return;
+  }
+
+  if (_refreshDir >= 0) {
+    _refreshSlice();
+    return;
+  }
+  if (_compactPending && !_scanFile && !_copySrc) {
+    _compact();
+    return;
+  }
+
+  if (!_scanFile && !_nextFileToScan()) {
+
+    // Nothing else to do; save the catalogs that changed (writing can be
+    // slow, so not while playing)
+    if (audioIdle) {
+      for (int dirNum = 0; dirNum < _numDirs; dirNum++) {
+        if (_dirs[dirNum].changed) {
+          _writeCatalog(dirNum);
+          _tc->log2("TactileFileManager: catalog written:");
+          _tc->log2(_dirPath(dirNum));
+          return;
+        }
+      }
+    }
+    return;
+  }
+
+  if (!_scanFile) {
+    char path[MAX_FILE_PATH + 1];
+    _makePath(path, &_files[_scanIndex]);
+    AudioNoInterrupts();
+    _scanFile = SD.open(path);
+    bool ok = _scanFile
+      && TactileWav::parseHeader(&_scanFile, &_scanInfo)
+      && TactileWav::isSupported(&_scanInfo);
+    AudioInterrupts();
+    _scanPos = 0;
+    _scanSilence = _files[_scanIndex].silence;
+    _scanLoudness = ok && _loudnessScan && _files[_scanIndex].loudness == LOUDNESS_UNKNOWN;
+    if (!ok) {
+      memset(&_scanInfo, 0, sizeof(_scanInfo));
+      _scanSilence = 0;
+      _finishScan();
+    } else if (_scanLoudness)
+      _meter.begin(_scanInfo.channels, _scanInfo.sampleRate);
+    return;
+  }
+
+  int16_t buf[SILENCE_SCAN_CHUNK / 2];
+  uint32_t n = SILENCE_SCAN_CHUNK;
+  if (n > _scanInfo.dataLength - _scanPos)
+    n = _scanInfo.dataLength - _scanPos;
+  AudioNoInterrupts();
+  int got = _scanFile.read(buf, n);
+  AudioInterrupts();
+
+  int samples = (got > 0) ? got / 2 : 0;
+  bool atEnd = (n == 0 || got < (int)n);
+  if (_scanLoudness)
+    _meter.add(buf, samples / _scanInfo.channels);
+
+  // The first sound. Silent all the way (or too far) to the end: don't
+  // skip anything.
+  if (_scanSilence == SILENCE_UNKNOWN) {
+    for (int i = 0; i < samples; i++) {
+      if (buf[i] > SILENCE_THRESHOLD || buf[i] < -SILENCE_THRESHOLD) {
+        uint32_t frame = (_scanPos / 2 + i) / _scanInfo.channels;
+        frame = (frame > SILENCE_PREROLL) ? frame - SILENCE_PREROLL : 0;
+        _scanSilence = frame * _scanInfo.blockAlign;
+        break;
+      }
+    }
+    if (_scanSilence == SILENCE_UNKNOWN && _scanPos + samples * 2 >= (uint32_t)SILENCE_MAX_SCAN * _scanInfo.blockAlign)
+      _scanSilence = 0;
+  }
+  _scanPos += samples * 2;
+
+  // Loudness needs the whole file; silence only needs the start
+  if (atEnd || (!_scanLoudness && _scanSilence != SILENCE_UNKNOWN))
+    _finishScan();
+}
+
+/*----------------------------------------------------------------------
+ * SD card changes
+ ----------------------------------------------------------------------*/
+
+void TactileFileManager::_checkCard() {
+  _lastCardCheck = millis();
+  AudioNoInterrupts();
+  bool present = SD.mediaPresent();
+  if (present && !_cardPresent)
+    present = SD.begin(SDCARD_CS_PIN);
+  AudioInterrupts();
+  if (present == _cardPresent)
+    return;
+
+  _cardPresent = present;
+  if (!present) {
+    _cardRemoved();
+    return;
+  }
+  _tc->log("TactileFileManager: SD card inserted; checking the catalog");
+  _refreshDir = ROOT_DIR;
+  _refreshStep = REFRESH_OPEN;
+}
+
+// Drops everything that was using the card. (Its files can't be closed
+// properly; this just forgets them.)
+
+void TactileFileManager::_cardRemoved() {
+  _tc->log("TactileFileManager: SD card removed");
+  if (_refreshDir >= 0)
+    _cancelRefreshDir();
+  _refreshDir = -1;
+  AudioNoInterrupts();
+  _scanFile.close();
+  _copySrc.close();
+  AudioInterrupts();
+  if (_copyDst) {
+    char path[MAX_FILE_PATH + 1];
+    _makePath(path, &_files[_copyIndex]);
+    _copyDst.close();
+    _flash->remove(path);
+  }
+}
+
+// One slice of refreshing the catalog: see the REFRESH_* steps.
+
+void TactileFileManager::_refreshSlice() {
+  TactileDir *d = &_dirs[_refreshDir];
+  File file;
+  int i;
+
+  switch (_refreshStep) {
+
+  case REFRESH_OPEN:
+    if (!d->loaded) {                   // it'll be read when it's first used
+      _nextRefreshDir();
+      return;
+    }
+    AudioNoInterrupts();
+    _refreshFile = SD.open(_dirPath(_refreshDir));
+    AudioInterrupts();
+    if (!_refreshFile) {                // it's gone
+      _tc->log("TactileFileManager: directory is missing:");
+      _tc->log(_dirPath(_refreshDir));
+      _refreshKey = 0;
+      _refreshFirst = _numFiles;
+      _finishRefreshDir();
+      return;
+    }
+    _refreshKey = HASH_INIT;
+    _refreshStep = REFRESH_HASH;
+    return;
+
+  case REFRESH_HASH:
+    AudioNoInterrupts();
+    for (i = 0; i < REFRESH_SLICE_ENTRIES && (file = _refreshFile.openNextFile()); i++) {
+      _refreshKey = hashEntry(_refreshKey, &file);
+      file.close();
+    }
+    AudioInterrupts();
+    if (i == REFRESH_SLICE_ENTRIES)
+      return;
+    _refreshKey |= 1;
+    break;                              // check the key, below
+
+  case REFRESH_READ:
+    AudioNoInterrupts();
+    for (i = 0; i < REFRESH_SLICE_ENTRIES && (file = _refreshFile.openNextFile()); i++) {
+      const char *name = file.name();
+      int len = strlen(name);
+      if (isEligible(name, len, file.isDirectory()))
+        _addFile(_refreshDir, name, len, file.size(), fileTime(&file));
+      file.close();
+    }
+    if (i < REFRESH_SLICE_ENTRIES)
+      _refreshFile.close();
+    AudioInterrupts();
+    if (i == REFRESH_SLICE_ENTRIES)
+      return;
+
+    {
+      // Sort the new list, and keep what's known about files that are
+      // still there (both lists are sorted, so it's one pass)
+      const char *names = _names;
+      TactileFileEntry *first = &_files[_refreshFirst];
+      TactileFileEntry *last = &_files[_numFiles];
+      std::sort(first, last, [names](const TactileFileEntry &a, const TactileFileEntry &b) {
+        return strcmp(names + a.name, names + b.name) < 0;
+      });
+      const TactileFileEntry *old = &_files[d->firstFile];
+      const TactileFileEntry *oldEnd = old + d->numFiles;
+      for (TactileFileEntry *entry = first; entry < last; entry++) {
+        int cmp = 1;
+        while (old < oldEnd && (cmp = strcmp(_nameOf(old), _nameOf(entry))) < 0)
+          old++;
+        if (old < oldEnd && cmp == 0 && old->size == entry->size && old->mtime == entry->mtime) {
+          entry->silence   = old->silence;
+          entry->info      = old->info;
+          entry->loudness  = old->loudness;
+          entry->peak      = old->peak;
+          entry->flags     = old->flags;
+          entry->playCount = old->playCount;
+        }
+      }
+    }
+    _refreshPos = _refreshFirst;
+    _refreshStep = REFRESH_WAV;
+    return;
+
+  case REFRESH_WAV:
+    while (_refreshPos < _numFiles && _files[_refreshPos].info.formatTag != 0)
+      _refreshPos++;                    // known already
+    if (_refreshPos >= _numFiles) {
+      _finishRefreshDir();
+      return;
+    }
+    _readWavHeader(&_files[_refreshPos++]);
+    return;
+  }
+
+  // The directory's key is known: has it changed?
+  AudioNoInterrupts();
+  _refreshFile.close();
+  AudioInterrupts();
+  if (_refreshKey == d->key) {
+    _tc->log2("TactileFileManager: directory hasn't changed:");
+    _tc->log2(_dirPath(_refreshDir));
+    _nextRefreshDir();
+    return;
+  }
+  _tc->log2("TactileFileManager: directory changed, reading it:");
+  _tc->log2(_dirPath(_refreshDir));
+  AudioNoInterrupts();
+  _refreshFile = SD.open(_dirPath(_refreshDir));
+  AudioInterrupts();
+  _refreshFirst = _numFiles;
+  _refreshStep = REFRESH_READ;
+}
+
+// Replaces a directory's files with the new list.
+
+void TactileFileManager::_finishRefreshDir() {
+  TactileDir *d = &_dirs[_refreshDir];
+  if (d->numFiles > 0)
+    _compactPending = true;             // the old list
+  d->firstFile = _refreshFirst;
+  d->numFiles  = _numFiles - _refreshFirst;
+  d->key       = _refreshKey;
+  d->changed   = (_refreshKey != 0);
+  if (_tc->getLogLevel() > 1) {
+    tactileLog.print(_dirPath(_refreshDir));
+    tactileLog.print(": ");
+    tactileLog.print(d->numFiles);
+    tactileLog.println(" files");
+  }
+  if (_flash)
+    _scanFlashDir(_refreshDir);
+  _nextRefreshDir();
+}
+
+void TactileFileManager::_nextRefreshDir() {
+  AudioNoInterrupts();
+  _refreshFile.close();
+  AudioInterrupts();
+  _refreshStep = REFRESH_OPEN;
+  if (++_refreshDir >= _numDirs) {
+    _refreshDir = -1;
+    _tc->log("TactileFileManager: catalog is up to date");
+  }
+}
+
+// Forgets a partly-read directory; its refresh starts again from the
+// beginning. (Its names stay in the arena until the next _compact().)
+
+void TactileFileManager::_cancelRefreshDir() {
+  AudioNoInterrupts();
+  _refreshFile.close();
+  AudioInterrupts();
+  if (_refreshStep >= REFRESH_READ) {
+    _numFiles = _refreshFirst;
+    _compactPending = true;
+  }
+  _refreshStep = REFRESH_OPEN;
+}
+
+// Frees the entries and names of directories that were replaced, by
+// copying everything that's still used into a new file table and arena.
+// It needs room for both for a moment; if there isn't any, the old ones
+// are kept. Any name handed out by getFileName() moves with them.
+
+void TactileFileManager::_compact() {
+  _compactPending = false;
+
+  uint32_t namesUsed = 1;
+  int numFiles = 0;
+  for (int dirNum = 0; dirNum < _numDirs; dirNum++) {
+    namesUsed += strlen(_dirPath(dirNum)) + 1;
+    for (int i = 0; i < _dirs[dirNum].numFiles; i++)
+      namesUsed += strlen(_nameOf(&_files[_dirs[dirNum].firstFile + i])) + 1;
+    numFiles += _dirs[dirNum].numFiles;
+  }
+  uint32_t namesSize = (namesUsed + NAME_ARENA_CHUNK - 1) / NAME_ARENA_CHUNK * NAME_ARENA_CHUNK;
+  int filesSize = (numFiles / CATALOG_CHUNK + 1) * CATALOG_CHUNK;
+  char *names = (char *)malloc(namesSize);
+  TactileFileEntry *files = (TactileFileEntry *)malloc(filesSize * sizeof(TactileFileEntry));
+  if (!names || !files) {
+    free(names);
+    free(files);
+    _tc->log2("TactileFileManager: not enough memory to compact the catalog");
+    return;
+  }
+
+  uint32_t used = 0;
+  names[used++] = 0;
+  int n = 0;
+  for (int dirNum = 0; dirNum < _numDirs; dirNum++) {
+    TactileDir *d = &_dirs[dirNum];
+    int len = strlen(_dirPath(dirNum));
+    memcpy(names + used, _dirPath(dirNum), len + 1);
+    d->path = used;
+    used += len + 1;
+    for (int i = 0; i < d->numFiles; i++) {
+      files[n + i] = _files[d->firstFile + i];
+      len = strlen(_nameOf(&files[n + i]));
+      memcpy(names + used, _nameOf(&files[n + i]), len + 1);
+      files[n + i].name = used;
+      used += len + 1;
+    }
+    d->firstFile = n;
+    n += d->numFiles;
+  }
+
+  free(_names);
+  free(_files);
+  _names = names;
+  _namesUsed = used;
+  _namesSize = namesSize;
+  _files = files;
+  _numFiles = n;
+  _filesSize = filesSize;
+  _scanIndex = 0;                       // (it's an index into the old table)
+  _tc->log2("TactileFileManager: catalog compacted");
+}
+
+/*----------------------------------------------------------------------
+ * Flash tier. The flash has the same directories as the SD card.
+ ----------------------------------------------------------------------*/
+
+bool TactileFileManager::useDefaultFlashTier() {
+  if (qspiFlash.begin()) {
+    _tc->log2("TactileFileManager: flash tier on the QSPI flash chip");
+    return setFlashTier(&qspiFlash);
+  }
+  if (programFlash.begin(FLASH_TIER_PROGRAM_SIZE)) {
+    _tc->log2("TactileFileManager: flash tier in program flash");
+    return setFlashTier(&programFlash);
+  }
+  _tc->log("TactileFileManager: no flash memory available for the flash tier");
+  return false;
+}
+
+bool TactileFileManager::setFlashTier(FS *fs) {
+
+  // Forget the old tier (including any copy in progress)
+  if (_copySrc || _copyDst) {
+    _copySrc.close();
+    _copyDst.close();
+  }
+  for (int i = 0; i < _numFiles; i++)
+    _files[i].flags &= ~(FILE_IN_FLASH | FILE_COPY_FAILED);
+  _flash = fs;
+  if (!_flash)
+    return true;
+
+  // Find out what's already there from last time (directories that
+  // haven't been read yet are checked when they are)
+  for (int dirNum = 0; dirNum < _numDirs; dirNum++) {
+    if (_dirs[dirNum].loaded)
+      _scanFlashDir(dirNum);
+  }
+  _copyPending = true;
+  return true;
+}
+
+// Marks the files in a flash directory that are current copies of files
+// on the SD card (same name, size and time), and removes any that aren't
+// (deleted or changed since they were copied). Removal restarts the directory listing each time,
+// since the directory can't be changed while it's being read.
+
+void TactileFileManager::_scanFlashDir(int dirNum) {
+  const char *dirPath = _dirPath(dirNum);
+  char name[MAX_FILE_NAME + 1];
+  char stale[MAX_FILE_PATH + 1];
+  int numInFlash = 0;
+
+  while (1) {
+    File dir = _flash->open(dirPath);
+    if (!dir)
+      return;
+    stale[0] = 0;
+    numInFlash = 0;
+    File file;
+    while ((file = dir.openNextFile())) {
+      strncpy(name, file.name(), MAX_FILE_NAME);
+      name[MAX_FILE_NAME] = 0;
+      bool isDir = file.isDirectory();
+      uint32_t size = file.size();
+      uint32_t mtime = fileTime(&file);
+      file.close();
+      if (isDir)
+        continue;
+      int fileNum = _findFile(dirNum, name, size, mtime);
+      if (fileNum >= 0) {
+        _files[_dirs[dirNum].firstFile + fileNum].flags |= FILE_IN_FLASH;
+        numInFlash++;
+      } else {
+        strcpy(stale, dirPath);
+        if (dirNum != ROOT_DIR)
+          strcat(stale, "/");
+        strcat(stale, name);
+        break;
+      }
+    }
+    dir.close();
+    if (!stale[0])
+      break;
+    _tc->log2("TactileFileManager: removing stale file from flash tier:");
+    _tc->log2(stale);
+    _flash->remove(stale);
+  }
+
+  if (_tc->getLogLevel() > 1) {
+    tactileLog.print("TactileFileManager: flash tier ");
+    tactileLog.print(dirPath);
+    tactileLog.print(": ");
+    tactileLog.println(numInFlash);
+  }
+}
+
+FS *TactileFileManager::getFileSystem(int fileNum) {
+  return getFileSystem(ROOT_DIR, fileNum);
+}
+
+FS *TactileFileManager::getFileSystem(int dirNum, int fileNum) {
+  TactileFileEntry *entry = _entry(dirNum, fileNum);
+  if (!_flash || !entry || !(entry->flags & FILE_IN_FLASH))
+    return &SD;
+  return _flash;
+}
+
+void TactileFileManager::notePlayed(int fileNum) {
+  notePlayed(ROOT_DIR, fileNum);
+}
+
+void TactileFileManager::notePlayed(int dirNum, int fileNum) {
+  TactileFileEntry *entry = _entry(dirNum, fileNum);
+  if (!entry)
+    return;
+  if (entry->playCount < 255)
+    entry->playCount++;
+  if (entry->playCount == FLASH_TIER_MIN_PLAYS)
+    _copyPending = true;
+}
+
+// Finds the next clip that should be in the flash tier but isn't.
+
+bool TactileFileManager::_nextFileToCopy() {
+  for (int i = 0; i < _numFiles; i++) {
+    const TactileFileEntry *entry = &_files[i];
+    if (entry->playCount >= FLASH_TIER_MIN_PLAYS
+        && entry->size > 0
+        && entry->size <= FLASH_TIER_MAX_CLIP
+        && !(entry->flags & (FILE_IN_FLASH | FILE_COPY_FAILED))) {
+      _copyIndex = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void TactileFileManager::_copyStep() {
+  char path[MAX_FILE_PATH + 1];
+
+  // Start the next copy
+  if (!_copySrc) {
+    if (!_nextFileToCopy()) {
+      _copyPending = false;
+      return;
+    }
+    TactileFileEntry *entry = &_files[_copyIndex];
+    if (_flash->totalSize() - _flash->usedSize() < entry->size + 8 * FLASH_COPY_CHUNK) {
+      entry->flags |= FILE_COPY_FAILED;
+      _tc->log2("TactileFileManager: flash tier is full");
+      return;
+    }
+
+    // Make the directory (and its parents)
+    strcpy(path, _dirPath(entry->dir));
+    for (char *p = path + 1; *p; p++) {
+      if (p[1] == '/' || p[1] == 0) {
+        char c = p[1];
+        p[1] = 0;
+        _flash->mkdir(path);
+        p[1] = c;
+      }
+    }
+
+    _makePath(path, entry);
+    _flash->remove(path);
+    _copyDst = _flash->open(path, FILE_WRITE);
+    AudioNoInterrupts();
+    _copySrc = SD.open(path);
+    AudioInterrupts();
+    if (!_copySrc || !_copyDst)
+      _finishCopy(false);
+    return;
+  }
+
+  // Copy the next chunk
+  uint8_t buf[FLASH_COPY_CHUNK];
+  AudioNoInterrupts();
+  int got = _copySrc.read(buf, sizeof(buf));
+  AudioInterrupts();
+  if (got > 0 && (int)_copyDst.write(buf, got) != got) {
+    _finishCopy(false);
+    return;
+  }
+  if (got < (int)sizeof(buf))
+    _finishCopy(got >= 0 && _copyDst.size() == _files[_copyIndex].size);
+}
+
+void TactileFileManager::_finishCopy(bool ok) {
+  TactileFileEntry *entry = &_files[_copyIndex];
+  char path[MAX_FILE_PATH + 1];
+  _makePath(path, entry);
+  if (ok) {                             // the copy has the original's time, see _scanFlashDir()
+    DateTimeFields tm;
+    AudioNoInterrupts();
+    bool haveTime = _copySrc.getModifyTime(tm);
+    AudioInterrupts();
+    if (haveTime)
+      _copyDst.setModifyTime(tm);
+  }
+  AudioNoInterrupts();
+  _copySrc.close();
+  AudioInterrupts();
+  _copyDst.close();
+  if (ok) {
+    entry->flags |= FILE_IN_FLASH;
+    _tc->log2("TactileFileManager: copied to flash tier:");
+  } else {
+    _flash->remove(path);
+    entry->flags |= FILE_COPY_FAILED;
+    _tc->log2("TactileFileManager: failed to copy to flash tier:");
+  }
+  _tc->log2(path);
+}
+
+/*----------------------------------------------------------------------
+ * SD card self-test
+ ----------------------------------------------------------------------*/
+
+bool TactileFileManager::testSDCard(TactileSDTest *result) {
+  memset(result, 0, sizeof(*result));
+
+  // Test with the biggest file in the catalog
+  int testIndex = -1;
+  for (int i = 0; i < _numFiles; i++) {
+    if (_files[i].size > result->testFileSize) {
+      result->testFileSize = _files[i].size;
+      testIndex = i;
+    }
+  }
+  uint32_t maxRead = SD_TEST_BLOCK_BYTES << (SD_TEST_READ_SIZES - 1);
+  if (testIndex < 0 || result->testFileSize < 2 * maxRead) {
+    _tc->log("TactileFileManager: SD card test: no file big enough to test with");
+    return false;
+  }
+  // Each SD card operation is done with the audio interrupt off, as
+  // elsewhere, although nothing should be playing (see the header).
+  char path[MAX_FILE_PATH + 1];
+  _makePath(path, &_files[testIndex]);
+  AudioNoInterrupts();
+  File file = SD.open(path);
+  AudioInterrupts();
+  if (!file) {
+    _tc->log("TactileFileManager: SD card test: can't open test file");
+    return false;
+  }
+
+  static uint8_t buf[SD_TEST_BLOCK_BYTES << (SD_TEST_READ_SIZES - 1)];
+
+  // Sustained throughput
+  uint32_t bytes = 0;
+  uint32_t start = micros();
+  while (bytes < SD_TEST_SUSTAINED_BYTES) {
+    AudioNoInterrupts();
+    int got = file.read(buf, sizeof(buf));
+    AudioInterrupts();
+    if (got <= 0)
+      break;
+    bytes += got;
+  }
+  uint32_t elapsed = micros() - start;
+  if (elapsed > 0)
+    result->sustainedKBps = (uint32_t)((uint64_t)bytes * 1000 / 1024 * 1000 / elapsed);
+
+  // Random reads, of each size
+  uint32_t positions = (result->testFileSize - maxRead) / SD_TEST_BLOCK_BYTES;
+  for (int size = 0; size < SD_TEST_READ_SIZES; size++) {
+    uint32_t n = SD_TEST_BLOCK_BYTES << size;
+    uint32_t total = 0;
+    for (int i = 0; i < SD_TEST_RANDOM_READS; i++) {
+      AudioNoInterrupts();
+      file.seek(random(positions) * SD_TEST_BLOCK_BYTES);
+      start = micros();
+      file.read(buf, n);
+      total += micros() - start;
+      AudioInterrupts();
+    }
+    result->randomReadMicros[size] = total / SD_TEST_RANDOM_READS;
+  }
+  AudioNoInterrupts();
+  file.close();
+  AudioInterrupts();
+
+  if (_tc->getLogLevel() > 0) {
+    tactileLog.print("TactileFileManager: SD card test: ");
+    tactileLog.print(result->sustainedKBps);
+    tactileLog.print(" KB/sec sustained, random reads (us):");
+    for (int size = 0; size < SD_TEST_READ_SIZES; size++) {
+      tactileLog.print(" ");
+      tactileLog.print(result->randomReadMicros[size]);
+    }
+    tactileLog.println();
+  }
+  return true;
 }
@@ -19,15 +19,81 @@
 */
 
 /*----------------------------------------------------------------------
- * A very simple "file manager" for the specific configuration of .WAV
- * files expected/supported for the Tactile system. On initialization,
- * the TactileFileManager class reads the contents of the SD file and
- * stores it. Subsequently, files in the root directory and the 
- * subdirectories E1-En are referred to by an integer index.
- *
- * (Note: The subdirectories are named starting with 1 (i.e. E1..EN)
- * for simplicity  with the expected use of this module, but are indexed
- * starting with zero.)
+ * A simple "file manager" for the .WAV files used by the Tactile system.
+ * It keeps a catalog of directories, each with a sorted list of its .WAV
+ * files, which are referred to by a directory number and an integer
+ * index. Directory ROOT_DIR is the root directory, whose first NUM_TRACKS
+ * files are the tracks; other directories (e.g. the ones that random-track
+ * mode chooses from) are added with findDirectory(), and there's no
+ * limit on how many there are or how many files they hold.
+ *
+ * Directories are read lazily: only when they're first used (normally
+ * when they're configured), so memory and startup time depend on what's
+ * used rather than on what's on the card.
+ *
+ * File names are kept in one packed "arena" (each name followed by its
+ * null), sized to what's actually on the card; the catalog just holds
+ * offsets into it.
+ *
+ * Each file's .WAV header is read when its directory is (not when it's
+ * played), so the player is given the format and the position of the
+ * audio data, and files it can't play are reported (and aren't played)
+ * up front.
+ *
+ * Reading a directory is slow when there are a lot of files, so the
+ * result (names, sizes, each file's .WAV format and length, and its
+ * leading silence, below) is saved in the directory itself, in
+ * CATALOG_FILE, and used instead the next time if the directory hasn't
+ * changed. That's checked with a hash of each file's name, size and
+ * modification time, which only needs the directory's entries, not the
+ * files themselves. (A directory's own modification time isn't enough:
+ * it doesn't change when a file is overwritten, and FAT doesn't always
+ * update it.) Deleting a CATALOG_FILE forces that directory to be read
+ * again.
+ *
+ * The file manager also finds each file's "leading silence": the offset
+ * of the first sound (the first sample louder than SILENCE_THRESHOLD), so
+ * the player can skip silence left over from editing. Files whose
+ * silence isn't in the catalog yet are scanned in the background, a
+ * small slice at a time (see doBackgroundTasks()), so startup time
+ * doesn't depend on the number of files.
+ *
+ * Optionally, there's a second, faster storage tier in flash memory (a
+ * LittleFS file system: the QSPI flash chip on a Teensy 4.1 if there is
+ * one, otherwise part of the program flash, or any FS given to
+ * setFlashTier(), e.g. a LittleFS_RAM for testing; the tests in test/
+ * run it on a PC with one kept in memory). Small clips that are played
+ * often (FLASH_TIER_MIN_PLAYS) are copied to it in the background, and
+ * from then on getFileSystem() returns the flash tier for them, so
+ * they're played from flash instead of the SD card. Copies
+ * are only made while nothing is playing, since the players also read
+ * the file systems from the audio interrupt.
+ *
+ * The card can be taken out and put back (or swapped for another) while
+ * the system runs. doBackgroundTasks() checks for it every
+ * CARD_CHECK_INTERVAL; while the card is out, only the flash tier can be
+ * played (isCardPresent() is false). When a card goes in, each directory
+ * that was loaded is checked, and only the ones whose key changed are
+ * read again. This is done a slice at a time (REFRESH_SLICE_ENTRIES
+ * directory entries, or one file's header, per call), so the sensors and
+ * tracks playing from flash aren't held up. A directory's files are
+ * replaced all at once when its new list is complete; until then its old
+ * list is used. When the refresh is done, the entries and names of the
+ * replaced lists are freed.
+ *
+ * The same background scan can also measure each file's loudness and
+ * peak (see TactileLoudness.h), which means reading all of it, so it's
+ * only done when asked for (setLoudnessScan()). They're kept in the
+ * catalog too, and getNormalizeGain() turns them into the gain that
+ * brings the file to NORMALIZE_TARGET without clipping.
+ *
+ * testSDCard() measures how fast the card actually is, using the
+ * biggest file in the catalog: sustained (sequential) throughput, and
+ * the average time of a read at a random place, for reads of 1, 2 and 4
+ * audio blocks. It's meant to be run at startup, before anything plays:
+ * the players' reads would skew the results, and the test's long run of
+ * reads would hold them up. TactileAudio::testSDCard() refuses to run
+ * while any player is active.
  ----------------------------------------------------------------------*/
 
 #ifndef TactileFileManager_h
@@ -35,27 +101,207 @@
 
 #include <SPI.h>
 #include <SD.h>
+#include <LittleFS.h>
 
 using namespace std;
 
 #include "TactileCPU.h"
+#include "TactileWav.h"
+#include "TactileLoudness.h"
+
+#define ROOT_DIR               0
+#define MAX_DIR_PATH           63         // longest directory path
+#define MAX_FILE_PATH          (MAX_DIR_PATH + 1 + MAX_FILE_NAME)
+
+#define NAME_ARENA_CHUNK       1024       // the name arena grows by this much at a time
+#define CATALOG_CHUNK          32         // the file and directory tables grow by this many
+
+#define CATALOG_FILE           "_CATALOG.BIN"   // in each directory
+#define CATALOG_VERSION        4
+
+#define SILENCE_THRESHOLD      64         // sample value, about -54 dB
+#define SILENCE_MAX_SCAN       (2*44100)  // give up after this many frames (2 sec)
+#define SILENCE_PREROLL        128        // frames to keep before the first sound
+#define SILENCE_SCAN_CHUNK     512        // bytes read per background slice
+#define SILENCE_UNKNOWN        0xFFFFFFFF
+
+#define NORMALIZE_TARGET       (-1600)    // centi-LUFS: -16 LUFS
+#define NORMALIZE_MAX_BOOST    12.0f      // dB; quiet files are raised by no more than this
+
+#define FLASH_TIER_MAX_CLIP     (256*1024)  // bytes; bigger files always play from the SD card
+#define FLASH_TIER_MIN_PLAYS    2           // plays before a clip is copied to flash
+#define FLASH_TIER_PROGRAM_SIZE (1024*1024) // program flash used if there's no QSPI flash chip
+#define FLASH_COPY_CHUNK        512         // bytes copied per background slice
+
+#define CARD_CHECK_INTERVAL    1000       // milliseconds between checks for the SD card
+#define REFRESH_SLICE_ENTRIES  8          // directory entries read per background slice
+
+#define SD_TEST_SUSTAINED_BYTES (256*1024)  // read sequentially for the throughput test
+#define SD_TEST_RANDOM_READS    32          // random reads per read size
+#define SD_TEST_READ_SIZES      3           // 1, 2 and 4 audio blocks
+#define SD_TEST_BLOCK_BYTES     512         // one stereo audio block
+
+struct TactileSDTest {
+  uint32_t sustainedKBps;                     // sequential read throughput
+  uint32_t randomReadMicros[SD_TEST_READ_SIZES];  // average, SD_TEST_BLOCK_BYTES << i at a random place
+  uint32_t testFileSize;
+};
+
+// Per-file flags
+#define FILE_IN_FLASH          0x01
+#define FILE_COPY_FAILED       0x02
+
+struct TactileFileEntry {
+  uint32_t       name;                      // offset into the name arena
+  uint32_t       size;
+  uint32_t       mtime;                     // modification time (see fileTime() in the .cpp file), 0 if unknown
+  uint32_t       silence;                   // leading silence, bytes (SILENCE_UNKNOWN if not scanned)
+  TactileWavInfo info;                      // formatTag 0 if it isn't a valid .WAV file
+  int16_t        loudness;                  // centi-LUFS (LOUDNESS_UNKNOWN if not measured)
+  uint16_t       peak;                      // largest sample
+  uint16_t       dir;
+  uint8_t        flags;
+  uint8_t        playCount;
+};
+
+struct TactileDir {
+  uint32_t path;                            // offset into the name arena, e.g. "/" or "/E1"
+  uint32_t key;                             // see _dirKey()
+  int      firstFile;                       // its files are _files[firstFile...]
+  int      numFiles;
+  bool     loaded;
+  bool     changed;                         // catalog needs to be written
+};
 
 class TactileFileManager {
 
  public:
   TactileFileManager(TactileCPU *tc);
 
-  // The main methods
+  // Names and paths returned here point into the catalog, which the
+  // background tasks can move (see _compact()): copy one that's needed
+  // after the next call to doBackgroundTasks().
+
+  // Directories. Returns the directory number, or -1 if it doesn't exist.
+  int         findDirectory(const char *path);
+  const char *getDirectoryPath(int dirNum);
+
+  // The main methods. fileNum alone refers to the root directory's tracks.
   const char *getFileName(int fileNum);
   const char *getFileName(int dirNum, int fileNum);
+  bool        getFilePath(char *path, int dirNum, int fileNum);   // path: MAX_FILE_PATH+1 chars
   int         getNumFiles(int dirNum);
 
+  // .WAV format and length (formatTag 0 if it isn't a valid .WAV file)
+  const TactileWavInfo *getWavInfo(int fileNum);
+  const TactileWavInfo *getWavInfo(int dirNum, int fileNum);
+  uint32_t    getDuration(int fileNum);              // milliseconds
+  uint32_t    getDuration(int dirNum, int fileNum);
+  bool        isPlayable(int fileNum);               // a .WAV format the player supports
+  bool        isPlayable(int dirNum, int fileNum);
+
+  // Leading silence, in bytes from the start of the audio data (0 if not known yet)
+  uint32_t    getLeadingSilence(int fileNum);
+  uint32_t    getLeadingSilence(int dirNum, int fileNum);
+  void        setSilenceScan(bool on);
+
+  // Loudness normalization: the gain (1.0 == none) to play the file at,
+  // from its measured loudness (1.0 if it hasn't been measured yet)
+  float       getNormalizeGain(int fileNum);
+  float       getNormalizeGain(int dirNum, int fileNum);
+  void        setLoudnessScan(bool on);
+
+  // Flash tier. getFileSystem() is where to play the file from.
+  bool        setFlashTier(FS *fs);          // NULL == no flash tier
+  bool        useDefaultFlashTier();
+  FS         *getFileSystem(int fileNum);
+  FS         *getFileSystem(int dirNum, int fileNum);
+  void        notePlayed(int fileNum);
+  void        notePlayed(int dirNum, int fileNum);
+
+  // SD card changes. isRefreshing(): directories are being checked after a card went in.
+  bool        isCardPresent() { return _cardPresent; }
+  bool        isRefreshing() { return _refreshDir >= 0; }
+
+  // Heap used by the catalog: the name arena, file table and directories
+  uint32_t    getCatalogBytes();
+
+  // Measures the SD card; false if there's no file big enough to test
+  // with. Only while nothing is playing (see above).
+  bool        testSDCard(TactileSDTest *result);
+
+  // Background work, a small slice per call. audioIdle: nothing is playing.
+  void        doBackgroundTasks(bool audioIdle);
+
  private:
-  char _fileNames[NUM_TRACKS][MAX_FILE_NAME];
-  char _subDirFileNames[NUM_SUBDIRS][NUM_TRACKS_IN_SUBDIR][MAX_FILE_NAME];
-  int  _numSubDirFiles[NUM_SUBDIRS];
+  char             *_names;                 // the name arena; offset 0 is always ""
+  uint32_t          _namesUsed;
+  uint32_t          _namesSize;
+  TactileFileEntry *_files;
+  int               _numFiles;
+  int               _filesSize;
+  TactileDir       *_dirs;
+  int               _numDirs;
+  int               _dirsSize;
+
+  // Background leading-silence and loudness scan
+  bool           _silenceScan;
+  bool           _loudnessScan;
+  int            _scanIndex;                // into _files
+  File           _scanFile;
+  TactileWavInfo _scanInfo;
+  uint32_t       _scanPos;                  // bytes of audio data examined so far
+  uint32_t       _scanSilence;              // SILENCE_UNKNOWN until the first sound
+  bool           _scanLoudness;             // this file's loudness is being measured
+  TactileLoudness _meter;
+
+  // Flash tier
+  FS            *_flash;
+  bool           _copyPending;              // a clip may be ready to copy
+  int            _copyIndex;                // into _files
+  File           _copySrc;
+  File           _copyDst;
+
+  // SD card changes, and refreshing the catalog afterwards
+  bool           _cardPresent;
+  uint32_t       _lastCardCheck;
+  int            _refreshDir;               // directory being checked, -1 if none
+  int            _refreshStep;              // REFRESH_* in the .cpp file
+  File           _refreshFile;              // the directory being read
+  uint32_t       _refreshKey;               // its new key (the hash so far)
+  int            _refreshFirst;             // its new files are _files[_refreshFirst...]
+  int            _refreshPos;               // next file whose header is read
+  bool           _compactPending;           // replaced entries to free
 
-  int _readDirIntoStringArray(File *dir, int subDirNum);
+  uint32_t  _addName(const char *name, int len);
+  const char *_nameOf(const TactileFileEntry *entry) { return _names + entry->name; }
+  const char *_dirPath(int dirNum) { return _names + _dirs[dirNum].path; }
+  int       _addDir(const char *path);
+  TactileFileEntry *_addFile(int dirNum, const char *name, int len, uint32_t size, uint32_t mtime);
+  TactileFileEntry *_entry(int dirNum, int fileNum);
+  void      _makePath(char *path, const TactileFileEntry *entry);
+  void      _loadDir(int dirNum);
+  void      _readDir(File *dir, int dirNum);
+  void      _readWavInfo(int dirNum);
+  void      _readWavHeader(TactileFileEntry *entry);
+  uint32_t  _dirKey(File *dir);
+  uint32_t  _hashDir(File *dir);
+  bool      _readCatalog(int dirNum, uint32_t key);
+  void      _writeCatalog(int dirNum);
+  int       _findFile(int dirNum, const char *name, uint32_t size, uint32_t mtime);
+  void      _scanFlashDir(int dirNum);
+  bool      _nextFileToCopy();
+  void      _copyStep();
+  void      _finishCopy(bool ok);
+  void      _checkCard();
+  void      _cardRemoved();
+  void      _refreshSlice();
+  void      _nextRefreshDir();
+  void      _finishRefreshDir();
+  void      _cancelRefreshDir();
+  void      _compact();
+  bool      _nextFileToScan();
+  void      _finishScan();
 
   TactileCPU *_tc;
 };
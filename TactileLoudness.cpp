@@ -0,0 +1,153 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+#include <math.h>
+
+#include "TactileLoudness.h"
+
+// The K-weighting filters of BS.1770, designed for the file's sample rate
+#define SHELF_GAIN_DB     3.99984f
+#define SHELF_FREQ        1681.97f
+#define SHELF_Q           0.70718f
+#define HIGH_PASS_FREQ    38.1355f
+#define HIGH_PASS_Q       0.50033f
+
+// Loudness of a mean square (full scale == 1.0)
+static float lufs(float meanSquare) {
+  return -0.691f + 10.0f * log10f(meanSquare);
+}
+
+void TactileLoudness::begin(int channels, uint32_t sampleRate) {
+  float fs = (float)sampleRate;
+
+  // High shelf (RBJ cookbook)
+  float A = powf(10.0f, SHELF_GAIN_DB / 40.0f);
+  float w0 = 2.0f * (float)M_PI * SHELF_FREQ / fs;
+  float cw = cosf(w0);
+  float alpha = sinf(w0) / (2.0f * SHELF_Q);
+  float sa = 2.0f * sqrtf(A) * alpha;
+  float a0 = (A + 1) - (A - 1) * cw + sa;
+  _shelf.b0 = A * ((A + 1) + (A - 1) * cw + sa) / a0;
+  _shelf.b1 = -2 * A * ((A - 1) + (A + 1) * cw) / a0;
+  _shelf.b2 = A * ((A + 1) + (A - 1) * cw - sa) / a0;
+  _shelf.a1 = 2 * ((A - 1) - (A + 1) * cw) / a0;
+  _shelf.a2 = ((A + 1) - (A - 1) * cw - sa) / a0;
+
+  // High pass
+  w0 = 2.0f * (float)M_PI * HIGH_PASS_FREQ / fs;
+  cw = cosf(w0);
+  alpha = sinf(w0) / (2.0f * HIGH_PASS_Q);
+  a0 = 1 + alpha;
+  _highPass.b0 = (1 + cw) / 2 / a0;
+  _highPass.b1 = -(1 + cw) / a0;
+  _highPass.b2 = (1 + cw) / 2 / a0;
+  _highPass.a1 = -2 * cw / a0;
+  _highPass.a2 = (1 - alpha) / a0;
+
+  memset(_state, 0, sizeof(_state));
+  memset(_hpState, 0, sizeof(_hpState));
+  memset(_binCount, 0, sizeof(_binCount));
+  memset(_binEnergy, 0, sizeof(_binEnergy));
+  _channels = (channels == 2) ? 2 : 1;
+  _blockFrames = sampleRate * LOUDNESS_BLOCK_MS / 1000;
+  _frames = 0;
+  _energy = 0;
+  _peak = 0;
+}
+
+// Both filters, direct form I. The high pass's input history is the
+// shelf's output history.
+
+float TactileLoudness::_filter(int channel, float x) {
+  float *s = _state[channel];           // x1, x2, y1, y2 of the shelf
+  float *h = _hpState[channel];         // y1, y2 of the high pass
+  float y = _shelf.b0 * x + _shelf.b1 * s[0] + _shelf.b2 * s[1] - _shelf.a1 * s[2] - _shelf.a2 * s[3];
+  float z = _highPass.b0 * y + _highPass.b1 * s[2] + _highPass.b2 * s[3] - _highPass.a1 * h[0] - _highPass.a2 * h[1];
+  s[1] = s[0];
+  s[0] = x;
+  s[3] = s[2];
+  s[2] = y;
+  h[1] = h[0];
+  h[0] = z;
+  return z;
+}
+
+void TactileLoudness::add(const int16_t *samples, int frames) {
+  for (int i = 0; i < frames; i++) {
+    for (int c = 0; c < _channels; c++) {
+      int16_t v = *samples++;
+      uint16_t a = (v < 0) ? -(int32_t)v : v;
+      if (a > _peak)
+        _peak = a;
+      float z = _filter(c, v * (1.0f / 32768.0f));
+      _energy += z * z;
+    }
+    if (++_frames >= _blockFrames)
+      _endBlock();
+  }
+}
+
+void TactileLoudness::_endBlock() {
+  float meanSquare = _energy / _frames;
+  _energy = 0;
+  _frames = 0;
+  if (meanSquare <= 0)
+    return;
+  int bin = (int)floorf(lufs(meanSquare)) + LOUDNESS_BINS;    // -70 LUFS is bin 0
+  if (bin < 0)
+    return;                             // below the absolute gate
+  if (bin >= LOUDNESS_BINS)
+    bin = LOUDNESS_BINS - 1;
+  _binCount[bin]++;
+  _binEnergy[bin] += meanSquare;
+}
+
+int16_t TactileLoudness::loudness() {
+
+  // A clip shorter than a block is measured as one short block
+  uint32_t total = 0;
+  for (int bin = 0; bin < LOUDNESS_BINS; bin++)
+    total += _binCount[bin];
+  if (total == 0 && _frames > 0)
+    _endBlock();
+
+  // Absolute gate (the histogram only has blocks above it), then relative
+  float energy = 0;
+  total = 0;
+  for (int bin = 0; bin < LOUDNESS_BINS; bin++) {
+    energy += _binEnergy[bin];
+    total += _binCount[bin];
+  }
+  if (total == 0)
+    return LOUDNESS_SILENT;
+  float gate = lufs(energy / total) - 10.0f;
+  int firstBin = (int)floorf(gate) + LOUDNESS_BINS;
+  if (firstBin < 0)
+    firstBin = 0;
+  energy = 0;
+  total = 0;
+  for (int bin = firstBin; bin < LOUDNESS_BINS; bin++) {
+    energy += _binEnergy[bin];
+    total += _binCount[bin];
+  }
+  if (total == 0)
+    return LOUDNESS_SILENT;
+  return (int16_t)lroundf(lufs(energy / total) * 100.0f);
+}
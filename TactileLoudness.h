@@ -0,0 +1,75 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+/*----------------------------------------------------------------------
+ * Measures a .WAV file's loudness and peak, for normalizing levels (see
+ * TactileFileManager's background scan). The file's samples are fed in
+ * with add(), in pieces of any size, and loudness() gives the result.
+ *
+ * Loudness is "integrated loudness" as in ITU-R BS.1770, in LUFS: the
+ * samples are K-weighted (a high shelf, then a high-pass filter), and
+ * the mean square is taken over 400 ms blocks. Blocks quieter than -70
+ * LUFS are ignored, and then so are blocks more than 10 LU below the
+ * average of the rest, so pauses don't make a file seem quieter than it
+ * sounds. To keep memory small and fixed, the blocks don't overlap, and
+ * they're kept as a histogram (1 LU bins), so the relative gate is to
+ * the nearest LU. That's well within what matters for matching levels.
+ ----------------------------------------------------------------------*/
+
+#ifndef TactileLoudness_h
+#define TactileLoudness_h 1
+
+#include <Arduino.h>
+
+#define LOUDNESS_UNKNOWN      (-32768)    // centi-LUFS
+#define LOUDNESS_SILENT       (-7000)     // -70 LUFS: nothing above the absolute gate
+#define LOUDNESS_BLOCK_MS     400
+#define LOUDNESS_BINS         70          // -70 to 0 LUFS, 1 LU each
+
+class TactileLoudness {
+
+ public:
+  void begin(int channels, uint32_t sampleRate);
+  void add(const int16_t *samples, int frames);    // interleaved if stereo
+
+  int16_t  loudness();                  // centi-LUFS (e.g. -2300 is -23 LUFS)
+  uint16_t peak() { return _peak; }     // largest sample (absolute value)
+
+ private:
+  struct Biquad {
+    float b0, b1, b2, a1, a2;
+  };
+  Biquad   _shelf;
+  Biquad   _highPass;
+  float    _state[2][4];                // per channel: x1, x2 (shelf) and y1, y2 of each stage
+  float    _hpState[2][2];
+  int      _channels;
+  uint32_t _blockFrames;
+  uint32_t _frames;                     // in the current block
+  float    _energy;                     // sum of squares in the current block
+  uint32_t _binCount[LOUDNESS_BINS];
+  float    _binEnergy[LOUDNESS_BINS];   // sum of the blocks' mean squares
+  uint16_t _peak;
+
+  float    _filter(int channel, float x);
+  void     _endBlock();
+};
+
+#endif
@@ -0,0 +1,56 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+/*----------------------------------------------------------------------
+ * A combination of interaction modes, fixed when the sketch is compiled.
+ * A sketch that always uses the same modes can name them once:
+ *
+ *     typedef TactileModes<true, false, false, false> Modes;  // multi-track
+ *
+ *     void setup() {
+ *       t = Tactile::setup();
+ *       t->setModes<Modes>();
+ *     }
+ *
+ *     void loop() {
+ *       t->loop<Modes>();
+ *     }
+ *
+ * and Tactile's loop is compiled for exactly that combination, with no
+ * tests of the mode settings for each sensor. The plain t->loop() does
+ * the same thing for whatever the modes are set to at the time, by
+ * choosing the matching version of the loop on each pass.
+ ----------------------------------------------------------------------*/
+
+#ifndef TactileModes_h
+#define TactileModes_h 1
+
+template <bool MultiTrack,              // see Tactile::setMultiTrackMode()
+          bool ContinueTrack,           // ... setContinueTrackMode()
+          bool TouchToStop,             // ... setTouchToStop()
+          bool ProximityAsVolume>       // ... setProximityAsVolumeMode()
+struct TactileModes {
+  static const bool multiTrack        = MultiTrack;
+  static const bool continueTrack     = ContinueTrack;
+  static const bool touchToStop       = TouchToStop;
+  static const bool proximityAsVolume = ProximityAsVolume;
+};
+
+#endif
@@ -0,0 +1,279 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+#include "TactilePlaylist.h"
+
+#define FEISTEL_ROUNDS     4
+#define NEW_ROUND_TRIES    8                // to avoid starting a round with the last file
+
+TactilePlaylist::TactilePlaylist() {
+  memset(&_state, 0, sizeof(_state));
+  _state.magic = PLAYLIST_MAGIC;
+  _state.mode = PLAYLIST_SHUFFLE;
+  _state.last = -1;
+  _changed = false;
+  _halfBits = 1;
+  _weights = NULL;
+  _aliasProb = NULL;
+  _alias = NULL;
+}
+
+TactilePlaylist::~TactilePlaylist() {
+  _freeTables();
+  free(_weights);
+}
+
+void TactilePlaylist::_freeTables() {
+  free(_aliasProb);
+  free(_alias);
+  _aliasProb = NULL;
+  _alias = NULL;
+}
+
+void TactilePlaylist::setMode(int mode) {
+  if (mode == _state.mode)
+    return;
+  _state.mode = mode;
+  _state.position = 0;
+  _changed = true;
+}
+
+void TactilePlaylist::setNumFiles(int numFiles) {
+  if (numFiles < 0)
+    numFiles = 0;
+  if ((uint32_t)numFiles == _state.numFiles)
+    return;
+  _state.numFiles = numFiles;
+  _state.position = 0;
+  _state.last = -1;
+  _changed = true;
+  _freeTables();
+  free(_weights);
+  _weights = NULL;
+
+  // The Feistel block is the smallest even number of bits that covers
+  // numFiles, so at most 3/4 of the values are out of range and
+  // cycle-walking takes 4 steps at the very most on average.
+  _halfBits = 1;
+  while ((1ULL << (2 * _halfBits)) < (uint64_t)numFiles)
+    _halfBits++;
+  _newRound();
+}
+
+bool TactilePlaylist::setWeight(int fileNum, int weight) {
+  if (fileNum < 0 || (uint32_t)fileNum >= _state.numFiles || weight < 0 || weight > PLAYLIST_MAX_WEIGHT)
+    return false;
+  if (!_weights) {
+    _weights = (uint8_t *)malloc(_state.numFiles);
+    if (!_weights)
+      return false;
+    memset(_weights, 1, _state.numFiles);
+  }
+  _weights[fileNum] = weight;
+  _freeTables();                        // made again when they're next needed
+  return true;
+}
+
+/*----------------------------------------------------------------------
+ * Shuffle
+ ----------------------------------------------------------------------*/
+
+// A permutation of 0..(4^_halfBits - 1), keyed by _state.key. Each round
+// swaps the halves and mixes one into the other, so it's a bijection
+// whatever the round function is.
+
+static uint32_t feistelRound(uint32_t half, uint32_t key, int round) {
+  uint32_t x = (half ^ key) + round * 0x9E3779B9;
+  x *= 0x85EBCA6B;
+  x ^= x >> 13;
+  x *= 0xC2B2AE35;
+  x ^= x >> 16;
+  return x;
+}
+
+uint32_t TactilePlaylist::_permute(uint32_t i) {
+  uint32_t mask = (1UL << _halfBits) - 1;
+  uint32_t left = i >> _halfBits;
+  uint32_t right = i & mask;
+  for (int round = 0; round < FEISTEL_ROUNDS; round++) {
+    uint32_t t = right;
+    right = left ^ (feistelRound(right, _state.key, round) & mask);
+    left = t;
+  }
+  return (left << _halfBits) | right;
+}
+
+// Starts a new order. It shouldn't start with the file that was just
+// played, so a few keys are tried.
+
+void TactilePlaylist::_newRound() {
+  _state.position = 0;
+  for (int tries = 0; tries < NEW_ROUND_TRIES; tries++) {
+    _state.key = ((uint32_t)random(0x10000) << 16) | random(0x10000);
+    if (_state.numFiles < 2)
+      break;
+    uint32_t first = _permute(0);
+    while (first >= _state.numFiles)
+      first = _permute(first);
+    if ((int)first != _state.last)
+      break;
+  }
+  _changed = true;
+}
+
+/*----------------------------------------------------------------------
+ * Weighted: Vose's alias method. Each file gets a slot holding the
+ * chance of choosing it (out of 65535) and an "alias" to choose
+ * otherwise; the slots are filled so that every file's overall chance
+ * is its weight over the total.
+ ----------------------------------------------------------------------*/
+
+bool TactilePlaylist::_buildAliasTables() {
+  int n = _state.numFiles;
+  _aliasProb = (uint16_t *)malloc(n * sizeof(uint16_t));
+  _alias = (uint32_t *)malloc(n * sizeof(uint32_t));
+  uint32_t *scaled = (uint32_t *)malloc(n * sizeof(uint32_t));
+  uint32_t *work = (uint32_t *)malloc(n * sizeof(uint32_t));   // small from the front, large from the back
+  if (!_aliasProb || !_alias || !scaled || !work) {
+    free(scaled);
+    free(work);
+    _freeTables();
+    return false;
+  }
+
+  uint32_t total = 0;
+  for (int i = 0; i < n; i++)
+    total += _weights ? _weights[i] : 1;
+  if (total == 0) {                     // all zero: choose evenly
+    for (int i = 0; i < n; i++) {
+      _aliasProb[i] = 0xFFFF;
+      _alias[i] = i;
+    }
+    free(scaled);
+    free(work);
+    return true;
+  }
+
+  // Each weight times n, so the average slot holds exactly "total"
+  int numSmall = 0;
+  int numLarge = 0;
+  for (int i = 0; i < n; i++) {
+    scaled[i] = (uint32_t)(_weights ? _weights[i] : 1) * n;
+    if (scaled[i] < total)
+      work[numSmall++] = i;
+    else
+      work[n - 1 - numLarge++] = i;
+  }
+  while (numSmall > 0 && numLarge > 0) {
+    int s = work[--numSmall];
+    int l = work[n - numLarge];
+    _aliasProb[s] = (uint16_t)((uint64_t)scaled[s] * 0xFFFF / total);
+    _alias[s] = l;
+    scaled[l] -= total - scaled[s];
+    if (scaled[l] < total) {            // it's small now
+      numLarge--;
+      work[numSmall++] = l;
+    }
+  }
+
+  // What's left is full (give or take rounding)
+  while (numSmall > 0) {
+    int s = work[--numSmall];
+    _aliasProb[s] = 0xFFFF;
+    _alias[s] = s;
+  }
+  while (numLarge > 0) {
+    int l = work[n - numLarge--];
+    _aliasProb[l] = 0xFFFF;
+    _alias[l] = l;
+  }
+  free(scaled);
+  free(work);
+  return true;
+}
+
+/*----------------------------------------------------------------------
+ * Choosing
+ ----------------------------------------------------------------------*/
+
+int TactilePlaylist::next() {
+  int n = _state.numFiles;
+  if (n < 1)
+    return -1;
+
+  int fileNum;
+  switch (_state.mode) {
+
+  case PLAYLIST_SEQUENTIAL:
+    if (_state.position >= (uint32_t)n)
+      _state.position = 0;
+    fileNum = _state.position++;
+    break;
+
+  case PLAYLIST_WEIGHTED:
+    if (!_aliasProb && !_buildAliasTables()) {
+      fileNum = random(n);              // no memory: at least choose something
+      break;
+    }
+    fileNum = random(n);
+    if ((uint32_t)random(0xFFFF) >= _aliasProb[fileNum])
+      fileNum = _alias[fileNum];
+    break;
+
+  default: {
+    if (_state.position >= (uint32_t)n)
+      _newRound();
+    uint32_t i = _permute(_state.position++);
+    while (i >= (uint32_t)n)
+      i = _permute(i);                  // cycle-walk back into range
+    fileNum = i;
+    break;
+  }
+  }
+
+  _state.last = fileNum;
+  _changed = true;
+  return fileNum;
+}
+
+uint32_t TactilePlaylist::getMemoryBytes() {
+  uint32_t bytes = 0;
+  if (_weights)
+    bytes += _state.numFiles;
+  if (_aliasProb)
+    bytes += _state.numFiles * (sizeof(*_aliasProb) + sizeof(*_alias));
+  return bytes;
+}
+
+const TactilePlaylistState *TactilePlaylist::getState() {
+  _changed = false;
+  return &_state;
+}
+
+bool TactilePlaylist::setState(const TactilePlaylistState *state) {
+  if (state->magic != PLAYLIST_MAGIC
+      || state->mode != _state.mode
+      || state->numFiles != _state.numFiles
+      || state->position > state->numFiles)
+    return false;
+  _state = *state;
+  _changed = false;
+  return true;
+}
@@ -0,0 +1,112 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+/*----------------------------------------------------------------------
+ * Chooses which file of a directory to play next, for random-track
+ * mode. There are three ways:
+ *
+ *   PLAYLIST_SHUFFLE: a "shuffle bag": every file is played once, in a
+ *   random order, before any is repeated; then there's a new order
+ *   (which never starts with the file that was just played). The order
+ *   isn't stored as a list: it's a random permutation of 0..N-1 made by
+ *   a small Feistel cipher with a random key, "cycle-walked" into range,
+ *   so the i'th file of the round is computed directly. That takes a
+ *   few steps on average, whatever the size of the directory, and the
+ *   whole state is the key and the position.
+ *
+ *   PLAYLIST_WEIGHTED: random, with each file's chance proportional to
+ *   its weight (setWeight(); all 1 to start with). Uses Vose's alias
+ *   method: one random file number and one random coin per choice.
+ *   The tables (6 bytes per file, plus 1 for the weights) are made when
+ *   the weights change.
+ *
+ *   PLAYLIST_SEQUENTIAL: in order, starting again after the last one.
+ *
+ * The state is small enough to save (getState()) and restore
+ * (setState()), e.g. in EEPROM, so a restart carries on where it was
+ * rather than starting the same order again.
+ ----------------------------------------------------------------------*/
+
+#ifndef TactilePlaylist_h
+#define TactilePlaylist_h 1
+
+#include <Arduino.h>
+
+#define PLAYLIST_SHUFFLE       0
+#define PLAYLIST_WEIGHTED      1
+#define PLAYLIST_SEQUENTIAL    2
+
+#define PLAYLIST_MAX_WEIGHT    255
+#define PLAYLIST_MAGIC         0x3250     // "P2": the state's layout (file numbers are 32 bits)
+
+struct TactilePlaylistState {
+  uint16_t magic;
+  uint8_t  mode;
+  uint8_t  reserved;
+  uint32_t numFiles;
+  uint32_t position;                      // shuffle and sequential: next in this round
+  uint32_t key;                           // shuffle: this round's order
+  int32_t  last;                          // last file chosen, or -1
+};
+
+class TactilePlaylist {
+
+ public:
+  TactilePlaylist();
+  ~TactilePlaylist();
+
+  void setMode(int mode);
+  int  getMode() { return _state.mode; }
+
+  // Starts again if the number changed (and forgets the weights)
+  void setNumFiles(int numFiles);
+  int  getNumFiles() { return _state.numFiles; }
+
+  // Weighted mode: 0 (never) to PLAYLIST_MAX_WEIGHT
+  bool setWeight(int fileNum, int weight);
+
+  // The next file to play, or -1 if there are no files
+  int  next();
+
+  // Saving and restoring. setState() is ignored (returns false) unless
+  // it's for the same number of files and mode. changed: since the last
+  // getState().
+  const TactilePlaylistState *getState();
+  bool setState(const TactilePlaylistState *state);
+  bool isChanged() { return _changed; }
+
+  // Heap used by the weights and alias tables
+  uint32_t getMemoryBytes();
+
+ private:
+  TactilePlaylistState _state;
+  bool      _changed;
+  int       _halfBits;                    // shuffle: bits in each half of the Feistel block
+  uint8_t  *_weights;                     // weighted: NULL until a weight is set
+  uint16_t *_aliasProb;                   // weighted: alias tables, NULL until built
+  uint32_t *_alias;
+
+  uint32_t  _permute(uint32_t i);
+  void      _newRound();
+  void      _freeTables();
+  bool      _buildAliasTables();
+};
+
+#endif
@@ -0,0 +1,149 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+#include "TactileProfiler.h"
+#include "TactileCPU.h"
+
+#if TACTILE_PROFILE
+
+#if !defined(__arm__)
+#include <chrono>
+#endif
+
+TactileProfiler tactileProfiler;
+
+static const char *phaseNames[PROFILE_PHASES] = {
+  "sensors", "interaction", "I/O", "fades", "timers", "logging"
+};
+
+TactileProfiler::TactileProfiler() {
+  reset();
+  _last = 0;
+}
+
+void TactileProfiler::reset() {
+  memset(_stats, 0, sizeof(_stats));
+  for (int phase = 0; phase < PROFILE_PHASES; phase++)
+    _stats[phase].minNanos = 0xFFFFFFFF;
+  _nested = 0;
+}
+
+#if defined(__arm__)
+
+uint32_t TactileProfiler::ticks() {
+  return ARM_DWT_CYCCNT;
+}
+
+// At the clock speed of the moment (see TactileCPU::setClockSpeed())
+uint32_t TactileProfiler::_toNanos(uint32_t ticks) {
+  return (uint32_t)((uint64_t)ticks * 1000 / (F_CPU_ACTUAL / 1000000));
+}
+
+#else
+
+uint32_t TactileProfiler::ticks() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint32_t TactileProfiler::_toNanos(uint32_t ticks) {
+  return ticks;
+}
+
+#endif
+
+void TactileProfiler::start() {
+#if defined(__arm__)
+  if (!(ARM_DWT_CTRL & ARM_DWT_CTRL_CYCCNTENA)) {    // (the Teensy 4 startup code normally does this)
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  }
+#endif
+  _last = ticks();
+  _nested = 0;
+}
+
+void TactileProfiler::mark(int phase) {
+  uint32_t t = ticks();
+  uint32_t elapsed = t - _last;
+  elapsed = (elapsed > _nested) ? elapsed - _nested : 0;
+  _add(phase, _toNanos(elapsed));
+  _last = t;
+  _nested = 0;
+}
+
+void TactileProfiler::skip() {
+  _last = ticks();
+  _nested = 0;
+}
+
+void TactileProfiler::addNested(int phase, uint32_t ticks) {
+  _add(phase, _toNanos(ticks));
+  _nested += ticks;
+}
+
+void TactileProfiler::_add(int phase, uint32_t nanos) {
+  TactileProfileStats *s = &_stats[phase];
+  s->count++;
+  s->totalNanos += nanos;
+  if (nanos < s->minNanos)
+    s->minNanos = nanos;
+  if (nanos > s->maxNanos)
+    s->maxNanos = nanos;
+  int bucket = 0;
+  while (bucket < PROFILE_BUCKETS - 1 && (nanos >> (bucket + 1)) != 0)
+    bucket++;
+  s->histogram[bucket]++;
+}
+
+// One line per phase (times in microseconds), then its histogram's
+// non-empty buckets, each labeled with its lower bound in nanoseconds.
+
+void TactileProfiler::print() {
+  for (int phase = 0; phase < PROFILE_PHASES; phase++) {
+    TactileProfileStats *s = &_stats[phase];
+    tactileLog.print(phaseNames[phase]);
+    tactileLog.print(": ");
+    tactileLog.print(s->count);
+    if (s->count == 0) {
+      tactileLog.println();
+      continue;
+    }
+    tactileLog.print(", min ");
+    tactileLog.print(s->minNanos / 1000.0, 3);
+    tactileLog.print(" us, mean ");
+    tactileLog.print((float)s->totalNanos / s->count / 1000.0, 3);
+    tactileLog.print(" us, max ");
+    tactileLog.print(s->maxNanos / 1000.0, 3);
+    tactileLog.println(" us");
+    tactileLog.print(" ");
+    for (int bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+      if (s->histogram[bucket] == 0)
+        continue;
+      tactileLog.print(" ");
+      tactileLog.print(1UL << bucket);
+      tactileLog.print(" ns: ");
+      tactileLog.print(s->histogram[bucket]);
+    }
+    tactileLog.println();
+  }
+}
+
+#endif
@@ -0,0 +1,114 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+/*----------------------------------------------------------------------
+ * Where the loop's time goes. Each pass of Tactile::loop() is divided
+ * into phases: the loop calls PROFILE_START() at the top, and each phase
+ * ends with PROFILE_MARK(phase), which counts the time since the last
+ * mark as that phase's. PROFILE_SKIP() ends a stretch that isn't counted
+ * (e.g. a tick that wasn't due). Logging is timed separately, wherever it
+ * happens (PROFILE_NESTED_BEGIN() and _END()), and taken out of the phase
+ * it happened in.
+ *
+ * For each phase there's the count, min, mean and max, and a histogram
+ * with a bucket per power of two nanoseconds. On the Teensy the times
+ * come from the ARM's cycle counter (DWT_CYCCNT), converted at the clock
+ * speed of the moment; elsewhere, e.g. a simulation on a PC, from the
+ * system's steady clock.
+ *
+ * It's compiled in only if TACTILE_PROFILE is 1; otherwise the macros
+ * are empty and there's no profiler at all.
+ ----------------------------------------------------------------------*/
+
+#ifndef TactileProfiler_h
+#define TactileProfiler_h 1
+
+#ifndef TACTILE_PROFILE
+#define TACTILE_PROFILE 0
+#endif
+
+#if TACTILE_PROFILE
+
+#include <Arduino.h>
+
+enum {
+  PROFILE_SENSORS,              // reading the sensors
+  PROFILE_INTERACTION,          // deciding what to do about them
+  PROFILE_IO,                   // opening tracks, background SD card work
+  PROFILE_FADES,
+  PROFILE_TIMERS,               // player events, stats, timeouts
+  PROFILE_LOGGING,
+  PROFILE_PHASES
+};
+
+#define PROFILE_BUCKETS 32
+
+struct TactileProfileStats {
+  uint32_t count;
+  uint32_t minNanos;
+  uint32_t maxNanos;
+  uint64_t totalNanos;
+  uint32_t histogram[PROFILE_BUCKETS];  // [i]: 2^i to 2^(i+1)-1 nanoseconds
+};
+
+class TactileProfiler {
+
+ public:
+  TactileProfiler();
+
+  void start();
+  void mark(int phase);                 // the time since the last mark or skip is this phase's
+  void skip();
+  void addNested(int phase, uint32_t ticks);   // timed inside another phase
+
+  static uint32_t ticks();              // CPU cycles, or nanoseconds on a PC (wraps around)
+
+  const TactileProfileStats *getStats(int phase) { return &_stats[phase]; }
+  void reset();
+  void print();                         // to the serial port
+
+ private:
+  TactileProfileStats _stats[PROFILE_PHASES];
+  uint32_t _last;
+  uint32_t _nested;                     // nested ticks since the last mark, to take out of it
+
+  static uint32_t _toNanos(uint32_t ticks);
+  void _add(int phase, uint32_t nanos);
+};
+
+extern TactileProfiler tactileProfiler;
+
+#define PROFILE_START()             tactileProfiler.start()
+#define PROFILE_MARK(phase)         tactileProfiler.mark(phase)
+#define PROFILE_SKIP()              tactileProfiler.skip()
+#define PROFILE_NESTED_BEGIN()      uint32_t _profileTicks = TactileProfiler::ticks()
+#define PROFILE_NESTED_END(phase)   tactileProfiler.addNested(phase, TactileProfiler::ticks() - _profileTicks)
+
+#else
+
+#define PROFILE_START()             do {} while (0)
+#define PROFILE_MARK(phase)         do {} while (0)
+#define PROFILE_SKIP()              do {} while (0)
+#define PROFILE_NESTED_BEGIN()      do {} while (0)
+#define PROFILE_NESTED_END(phase)   do {} while (0)
+
+#endif
+
+#endif
@@ -34,10 +34,10 @@ TactileSensors* TactileSensors::setup(TactileCPU *tc) {
   // Note: it might seem like this could be a static object declared at the
   // program start, but that doesn't work due to some out-of-sequence
   // operations that would occur before the hardware is ready. By creating
-  // the TactileSensors object dynamically during the Arduino setup()
-  // function, we avoid those problems.
+  // the TactileSensors object during the Arduino setup() function (in its
+  // static storage, see tactileStorage()), we avoid those problems.
 
-  TactileSensors* t = new TactileSensors(tc);
+  TactileSensors* t = new(tactileStorage<TactileSensors>()) TactileSensors(tc);
 
   for (int sensorNumber = FIRST_SENSOR; sensorNumber <= LAST_SENSOR; sensorNumber++) {
     t->_lastActionTime[sensorNumber] = 0;
@@ -51,7 +51,7 @@ TactileSensors* TactileSensors::setup(TactileCPU *tc) {
   t->_lastSensorTouched = -1;
   t->_touchToggleMode = false;
 
-  t->setAveragingStrength(200);
+  t->setAveragingStrength(10);        // about 10 msec: the sensors are read at 1 kHz (see Tactile::loop())
 
   return t;
 }
@@ -97,8 +97,8 @@ void TactileSensors::setTouchReleaseThresholds(int sensorNumber, float touchThre
     _releaseThreshold[sensorNumber] = releaseThreshold;
 
   if (_tc->getLogLevel() > 1) {
-    Serial.print(sensorNumber);
-    Serial.print(": ");
+    tactileLog.print(sensorNumber);
+    tactileLog.print(": ");
   }
   _tc->logAction2("TactileSensors: Touch threshold: ", _touchThreshold[sensorNumber]);
   _tc->logAction2("TactileSensors: Release threshold: ", _releaseThreshold[sensorNumber]);
@@ -175,16 +175,16 @@ int TactileSensors::getTouchStatus(int sensorStatus[], int sensorChanges[]) {
   }
 
   if (numChanges > 0 && _tc->getLogLevel() > 1) {
-    Serial.print("TactileSensors: ");
-    Serial.print(numChanges);
-    Serial.print(" changed, ");
+    tactileLog.print("TactileSensors: ");
+    tactileLog.print(numChanges);
+    tactileLog.print(" changed, ");
     for (int i = FIRST_SENSOR; i <= LAST_SENSOR; i++) {
-      if      (sensorChanges[i] == NEW_TOUCH)   Serial.print("T");
-      else if (sensorChanges[i] == NEW_RELEASE) Serial.print("R");
-      else if (sensorStatus[i]  == IS_TOUCHED)  Serial.print("t");
-      else if (sensorStatus[i]  == IS_RELEASED) Serial.print("r");
+      if      (sensorChanges[i] == NEW_TOUCH)   tactileLog.print("T");
+      else if (sensorChanges[i] == NEW_RELEASE) tactileLog.print("R");
+      else if (sensorStatus[i]  == IS_TOUCHED)  tactileLog.print("t");
+      else if (sensorStatus[i]  == IS_RELEASED) tactileLog.print("r");
     }
-    Serial.println();
+    tactileLog.println();
   }
 
   return numChanges;
@@ -218,6 +218,24 @@ float TactileSensors::getProximityPercent(int sensorNumber) {
       (_filteredSensorValue[sensorNumber] * (_averagingSamples - 1) + (float)p) / (float)_averagingSamples;
     p = (int)_filteredSensorValue[sensorNumber];
   }
+  return _toPercent(sensorNumber, p);
+}
+
+// For reading the sensors much less often than 1 kHz (e.g. while idle): the
+// filter's strength is in samples, so at 50 Hz it would be 20 times slower.
+// The raw value becomes the filter's starting point, so the smoothed readings
+// that follow pick up from here rather than from wherever it left off.
+
+float TactileSensors::getRawProximityPercent(int sensorNumber) {
+  if (_ignoreSensor[sensorNumber])
+    return 0.0;
+  sensorNumber = _checkSensorRange(sensorNumber);
+  int p = analogRead(_sensorNumberToPinNumber[sensorNumber]);
+  _filteredSensorValue[sensorNumber] = (float)p;
+  return _toPercent(sensorNumber, p);
+}
+
+float TactileSensors::_toPercent(int sensorNumber, int p) {
   p = p * 100.0 * _proximityMultiplier[sensorNumber] / 1024;  // convert digital signal to percent
   if (p > 100.0)
     p = 100.0;
@@ -46,6 +46,7 @@ class TactileSensors
   void  setTouchToggleMode(bool on);
   int   getTouchStatus(int sensorStatus[], int sensorChanges[]);
   float getProximityPercent(int sensorNumber);
+  float getRawProximityPercent(int sensorNumber);   // unsmoothed; restarts the smoothing from here
   void  setAveragingStrength(int samples);
   void  setProximityMultiplier(int sensorNumber, float m);
 
@@ -72,7 +73,8 @@ class TactileSensors
   float _filteredSensorValue[NUM_SENSORS];
   int   _averagingSamples;
 
-  int _checkSensorRange(int sensorNumber);
+  int   _checkSensorRange(int sensorNumber);
+  float _toPercent(int sensorNumber, int p);
 
 };
 
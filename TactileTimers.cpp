@@ -0,0 +1,97 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+#include "TactileTimers.h"
+
+TactileTimers::TactileTimers() {
+  _size = 0;
+  for (int id = 0; id < TIMERS_MAX; id++)
+    _pos[id] = -1;
+}
+
+void TactileTimers::set(int id, uint32_t when) {
+  if (id < 0 || id >= TIMERS_MAX)
+    return;
+  int i = _pos[id];
+  if (i < 0) {
+    i = _size++;
+    _heap[i].id = id;
+    _pos[id] = i;
+  }
+  _heap[i].when = when;
+  _up(i);
+  _down(_pos[id]);
+}
+
+void TactileTimers::cancel(int id) {
+  if (isSet(id))
+    _remove(_pos[id]);
+}
+
+int TactileTimers::due(uint32_t now) {
+  if (_size == 0 || (int32_t)(now - _heap[0].when) < 0)
+    return -1;
+  int id = _heap[0].id;
+  _remove(0);
+  return id;
+}
+
+void TactileTimers::_swap(int a, int b) {
+  Timer t = _heap[a];
+  _heap[a] = _heap[b];
+  _heap[b] = t;
+  _pos[_heap[a].id] = a;
+  _pos[_heap[b].id] = b;
+}
+
+void TactileTimers::_up(int i) {
+  while (i > 0 && _before(i, (i - 1) / 2)) {
+    _swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+void TactileTimers::_down(int i) {
+  while (1) {
+    int first = i;
+    int left = 2 * i + 1;
+    int right = left + 1;
+    if (left < _size && _before(left, first))
+      first = left;
+    if (right < _size && _before(right, first))
+      first = right;
+    if (first == i)
+      return;
+    _swap(i, first);
+    i = first;
+  }
+}
+
+void TactileTimers::_remove(int i) {
+  int id = _heap[i].id;
+  _size--;
+  if (i != _size) {
+    _swap(i, _size);                    // the last one fills the gap...
+    int moved = _heap[i].id;
+    _up(i);                             // ...and goes wherever it belongs
+    _down(_pos[moved]);
+  }
+  _pos[id] = -1;
+}
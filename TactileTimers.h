@@ -0,0 +1,69 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+/*----------------------------------------------------------------------
+ * A small set of deadlines (in milliseconds, millis() time), so that
+ * things like fades and the inactivity timeout are only looked at when
+ * they're due, instead of being checked on every pass of the loop.
+ *
+ * Each timer has a small integer id (0 to TIMERS_MAX-1), chosen by the
+ * user, and is either set (to a time) or not. They're kept in a binary
+ * min-heap, so finding out that nothing is due is one comparison, and
+ * setting, cancelling or firing a timer is O(log n) for the handful
+ * there are. Times wrap around like millis(); deadlines just have to be
+ * within about 24 days of each other.
+ ----------------------------------------------------------------------*/
+
+#ifndef TactileTimers_h
+#define TactileTimers_h 1
+
+#include <Arduino.h>
+
+#define TIMERS_MAX 16
+
+class TactileTimers {
+
+ public:
+  TactileTimers();
+
+  void set(int id, uint32_t when);      // (re)sets the timer
+  void cancel(int id);
+  bool isSet(int id) { return id >= 0 && id < TIMERS_MAX && _pos[id] >= 0; }
+
+  // A timer that's due at "now" (it's removed), or -1 if there isn't one
+  int  due(uint32_t now);
+
+ private:
+  struct Timer {
+    uint32_t when;
+    uint8_t  id;
+  };
+  Timer  _heap[TIMERS_MAX];
+  int8_t _pos[TIMERS_MAX];              // each id's place in _heap, -1 if not set
+  int    _size;
+
+  bool _before(int a, int b) { return (int32_t)(_heap[a].when - _heap[b].when) < 0; }
+  void _swap(int a, int b);
+  void _up(int i);
+  void _down(int i);
+  void _remove(int i);
+};
+
+#endif
@@ -0,0 +1,96 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+
+#include "Arduino.h"
+#include "TactileWav.h"
+
+#define WAV_MAX_CHUNKS 16       // give up if the data chunk isn't found in this many chunks
+
+static uint16_t _le16(const uint8_t *p) {
+  return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static uint32_t _le32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool TactileWav::parseHeader(File *file, TactileWavInfo *info) {
+  uint8_t buf[16];
+  bool haveFormat = false;
+
+  memset(info, 0, sizeof(*info));
+
+  if (file->read(buf, 12) != 12
+      || memcmp(buf, "RIFF", 4) != 0
+      || memcmp(buf + 8, "WAVE", 4) != 0)
+    return false;
+
+  uint32_t fileSize = file->size();
+  for (int chunk = 0; chunk < WAV_MAX_CHUNKS; chunk++) {
+    if (file->read(buf, 8) != 8)
+      return false;
+    uint32_t chunkSize = _le32(buf + 4);
+    uint32_t chunkStart = file->position();
+    if (chunkStart > fileSize)
+      return false;
+
+    // Sizes come from the file, so they're compared with what's left of
+    // it rather than added to chunkStart, which could wrap around.
+    bool truncated = chunkSize > fileSize - chunkStart;
+
+    if (memcmp(buf, "fmt ", 4) == 0) {
+      if (chunkSize < 16 || file->read(buf, 16) != 16)
+        return false;
+      info->formatTag     = _le16(buf);
+      info->channels      = _le16(buf + 2);
+      info->sampleRate    = _le32(buf + 4);
+      info->blockAlign    = _le16(buf + 12);
+      info->bitsPerSample = _le16(buf + 14);
+      haveFormat = true;
+    }
+    else if (memcmp(buf, "data", 4) == 0) {
+      if (!haveFormat)
+        return false;
+      info->dataOffset = chunkStart;
+      if (truncated) {                    // truncated file: play the whole frames that are there
+        chunkSize = fileSize - chunkStart;
+        if (info->blockAlign > 0)
+          chunkSize -= chunkSize % info->blockAlign;
+      }
+      info->dataLength = chunkSize;
+      return true;
+    }
+
+    // Chunks are padded to an even number of bytes
+    if (truncated || !file->seek(chunkStart + chunkSize + (chunkSize & 1)))
+      return false;
+  }
+  return false;
+}
+
+bool TactileWav::isSupported(const TactileWavInfo *info) {
+  return info->formatTag == 1
+    && info->bitsPerSample == 16
+    && (info->channels == 1 || info->channels == 2)
+    && info->sampleRate == 44100
+    && info->blockAlign == info->channels * 2          // the player divides by it, and assumes it
+    && info->dataLength % info->blockAlign == 0;
+}
@@ -0,0 +1,60 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+
+/*----------------------------------------------------------------------
+ * Minimal parsing of .WAV (RIFF) file headers. This is shared by the
+ * audio player, which needs to find the audio data, and the file
+ * manager, which looks inside the files when it builds its catalog.
+ *
+ * Only the "fmt " and "data" chunks are examined; any other chunks
+ * (LIST, bext, cue, etc.) that precede the audio data are skipped.
+ ----------------------------------------------------------------------*/
+
+#ifndef TactileWav_h
+#define TactileWav_h 1
+
+#include <SD.h>
+
+struct TactileWavInfo {
+  uint32_t dataOffset;          // byte offset of the first audio sample in the file
+  uint32_t dataLength;          // bytes of audio data
+  uint32_t sampleRate;
+  uint16_t formatTag;           // 1 == PCM
+  uint16_t channels;
+  uint16_t bitsPerSample;
+  uint16_t blockAlign;          // bytes per sample frame (all channels)
+};
+
+class TactileWav {
+
+ public:
+
+  // Reads the header of an open file. On success, the file is left
+  // positioned at the first byte of audio data.
+  static bool parseHeader(File *file, TactileWavInfo *info);
+
+  // True if the format is one the player can stream: 16-bit PCM, mono
+  // or stereo, at the audio library's sample rate (44.1 kHz), with a
+  // consistent frame size (blockAlign) and a whole number of frames.
+  static bool isSupported(const TactileWavInfo *info);
+};
+
+#endif
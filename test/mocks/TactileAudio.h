@@ -0,0 +1,152 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+/*----------------------------------------------------------------------
+ * TactileAudio for the tests. It keeps track of which tracks are
+ * playing and paused, and adds what it's asked to do to hostTrace.
+ * Tracks end by themselves now and then (in doTimerTasks(), chosen by
+ * hostRandom()), as they would when they reach the end of the file.
+ ----------------------------------------------------------------------*/
+
+#ifndef TactileAudio_h
+#define TactileAudio_h 1
+
+#include <string>
+#include "TactileCPU.h"
+#include "TactileTimers.h"
+
+#define PLAYER_BLOCK_MICROS  2902
+#define AUDIO_POOL_BYTES     0
+#define AUDIO_PLAYER_BYTES   0
+#define AUDIO_OUTPUT_MA      10.0
+
+inline uint32_t hostRandomState = 1;
+
+inline uint32_t hostRandom() {
+  hostRandomState ^= hostRandomState << 13;
+  hostRandomState ^= hostRandomState >> 17;
+  hostRandomState ^= hostRandomState << 5;
+  return hostRandomState;
+}
+
+struct TactileAudioStats { int blocksUsed; };
+struct AudioPlayerStats { uint32_t underruns; };
+
+struct TactileTrackStatus {
+  bool     playing;
+  bool     paused;
+  bool     fading;
+  float    gain;
+};
+
+class TactileFileManager {
+ public:
+  uint32_t getCatalogBytes() { return 0; }
+};
+
+class TactileAudio {
+ public:
+  static TactileAudio *setup(TactileCPU *tc) { static TactileAudio ta; ta = TactileAudio(); return &ta; }
+
+  const char *getTrackName(int trackNum) { return ""; }
+  uint32_t    getTrackDuration(int trackNum) { return 0; }
+
+  void setVolume(int percent) {}
+  void setVolume(int trackNumber, int percent) { _trace("volume", trackNumber, percent); }
+  void setFadeInTime(int milliseconds) {}
+  void setFadeOutTime(int milliseconds) {}
+  void cancelFades(int trackNumber) { _trace("cancel fades", trackNumber); }
+  void setPlayRandomTrackMode(bool on) {}
+  bool setTrackDirectory(int trackNumber, const char *path) { return true; }
+  void setPlaylistMode(int mode) {}
+  bool setRandomTrackWeight(int trackNumber, const char *fileName, int weight) { return true; }
+  void setPlaylistSaving(bool on) {}
+  void setLoopMode(bool on) {}
+  void setStemMode(bool on) {}
+  void setSkipLeadingSilence(bool on) {}
+  void setNormalizeMode(bool on) {}
+  void setFlashTierMode(bool on) {}
+  void setOutputPower(bool on) { _trace("output power", on); }
+  bool getOutputPower() { return true; }
+  bool isAudioIdle() {
+    for (int t = 0; t < NUM_TRACKS; t++)
+      if (_status[t].playing)
+        return false;
+    return true;
+  }
+
+  void startTrack(int t)  { _trace("start", t); _status[t].playing = true; _status[t].paused = false; }
+  void stopTrack(int t)   { _trace("stop", t); _status[t].playing = false; _status[t].paused = false; }
+  void pauseTrack(int t)  { _trace("pause", t); _status[t].paused = true; }
+  void resumeTrack(int t) { _trace("resume", t); _status[t].paused = false; }
+  int  cancelAll() {
+    int n = 0;
+    for (int t = 0; t < NUM_TRACKS; t++) {
+      n += _status[t].playing;
+      _status[t].playing = _status[t].paused = false;
+    }
+    _trace("cancel all", n);
+    return n;
+  }
+
+  uint32_t getSampleTime() { return 0; }
+  void scheduleStart(int t, uint32_t sampleTime) { startTrack(t); }
+  void scheduleStop(int t, uint32_t sampleTime) { stopTrack(t); }
+  void setQuantizeGrid(int milliseconds) {}
+
+  void updateTrackStatus() {}
+  const TactileTrackStatus *getTrackStatus() { return _status; }
+
+  void getAudioStats(TactileAudioStats *stats) {}
+  void resetAudioStats() {}
+  void setAudioStatsInterval(int milliseconds) {}
+  void getPlayerStats(int trackNumber, AudioPlayerStats *stats) {}
+  int  testSDCard() { return NUM_TRACKS; }
+  int  getMaxVoices() { return NUM_TRACKS; }
+  void setVoiceStealing(bool on) {}
+  void printPlayerStats() {}
+  uint32_t getAudioPoolBytesUsed() { return 0; }
+  uint32_t getPlaylistBytes() { return 0; }
+  TactileFileManager *getFileManager() { return &_fm; }
+
+  bool doIOTasks() { return hostRandom() % 4 == 0; }
+  void doTimerTasks() {
+    if (hostRandom() % 64 == 0) {
+      int t = hostRandom() % NUM_TRACKS;
+      if (_status[t].playing && !_status[t].paused) {
+        _status[t].playing = false;
+        _trace("end of track", t);
+      }
+    }
+  }
+
+ private:
+  TactileTrackStatus _status[NUM_TRACKS] = {};
+  TactileFileManager _fm;
+
+  void _trace(const char *what, int t, int value = -1) {
+    hostTrace += std::string(what) + " " + std::to_string(t);
+    if (value >= 0)
+      hostTrace += " " + std::to_string(value);
+    hostTrace += "\n";
+  }
+};
+
+#endif
@@ -0,0 +1,76 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+/*----------------------------------------------------------------------
+ * TactileCPU for the tests. What the code under test does that can be
+ * seen from outside (the LED, logged actions) is added to hostTrace,
+ * and everything logged goes to hostLog, so a test can compare them.
+ ----------------------------------------------------------------------*/
+
+#ifndef TactileCPU_h
+#define TactileCPU_h 1
+
+#include <Arduino.h>
+#include <string>
+#include "TactileBasics.h"
+
+#define TC_FULL_CLOCK_HZ   F_CPU
+#define TC_IDLE_CLOCK_HZ   24000000
+
+#ifndef TACTILE_MAX_LOG_LEVEL
+#define TACTILE_MAX_LOG_LEVEL 2
+#endif
+
+inline std::string hostTrace;
+inline std::string hostLog;
+
+class TactileLog : public Print {
+ public:
+  size_t write(uint8_t b) { hostLog += (char)b; return 1; }
+  using Print::write;
+  void     setAsync(bool on) {}
+  bool     drain() { return false; }
+  uint32_t getDropped() { return 0; }
+};
+
+inline TactileLog tactileLog;
+
+class TactileCPU {
+ public:
+  static TactileCPU *setup() { static TactileCPU tc; tc = TactileCPU(); return &tc; }
+  void turnLedOn()  { if (!_led) hostTrace += "led on\n"; _led = true; }
+  void turnLedOff() { if (_led) hostTrace += "led off\n"; _led = false; }
+  void setLogLevel(int level) { _logLevel = level; }
+  int  getLogLevel() { return _logLevel; }
+  void log(const char *msg)                   { if (_logLevel >= 1) tactileLog.println(msg); }
+  void log2(const char *msg)                  { if (_logLevel >= 2) tactileLog.println(msg); }
+  void logAction(const char *msg, int track)  { hostTrace += std::string(msg) + std::to_string(track) + "\n"; }
+  void logAction2(const char *msg, int track) {}
+  void waitForInterrupt() {}
+  uint32_t getSleepMicros() { return 0; }
+  void     setClockSpeed(uint32_t hz) { hostTrace += "clock " + std::to_string(hz) + "\n"; }
+  float    estimateCurrent(float awakeFraction) { return 0.0; }
+
+ private:
+  bool _led = false;
+  int  _logLevel = 1;
+};
+
+#endif
@@ -0,0 +1,66 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+// TactileSensors for the tests: the sensors read whatever the test puts
+// in hostTouched[] and hostProximity[].
+
+#ifndef TactileSensors_h
+#define TactileSensors_h 1
+
+#include "TactileCPU.h"
+
+#define IS_TOUCHED 1
+#define IS_RELEASED 0
+#define TOUCH_NO_CHANGE 0
+#define NEW_TOUCH 1
+#define NEW_RELEASE 2
+
+inline bool  hostTouched[NUM_SENSORS];
+inline float hostProximity[NUM_SENSORS];      // percent
+
+class TactileSensors {
+ public:
+  static TactileSensors *setup(TactileCPU *tc) { static TactileSensors ts; ts = TactileSensors(); return &ts; }
+
+  void  setTouchReleaseThresholds(int sensorNumber, float touchThreshold, float releaseThreshold) {}
+  void  ignoreSensor(int sensorNumber, bool ignore) {}
+  void  setTouchToggleMode(bool on) {}
+  int   getTouchStatus(int sensorStatus[], int sensorChanges[]) {
+    int numChanged = 0;
+    for (int s = FIRST_SENSOR; s <= LAST_SENSOR; s++) {
+      sensorStatus[s] = hostTouched[s] ? IS_TOUCHED : IS_RELEASED;
+      sensorChanges[s] = (hostTouched[s] == _touched[s]) ? TOUCH_NO_CHANGE
+                         : hostTouched[s] ? NEW_TOUCH : NEW_RELEASE;
+      if (sensorChanges[s] != TOUCH_NO_CHANGE)
+        numChanged++;
+      _touched[s] = hostTouched[s];
+    }
+    return numChanged;
+  }
+  float getProximityPercent(int sensorNumber) { return hostProximity[sensorNumber]; }
+  float getRawProximityPercent(int sensorNumber) { return hostProximity[sensorNumber]; }
+  void  setAveragingStrength(int samples) {}
+  void  setProximityMultiplier(int sensorNumber, float m) {}
+
+ private:
+  bool _touched[NUM_SENSORS] = {};
+};
+
+#endif
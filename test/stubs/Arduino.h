@@ -0,0 +1,97 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+/*----------------------------------------------------------------------
+ * Just enough of the Teensy core to build parts of Tactile on a PC, for
+ * the tests. The clock doesn't run by itself: it's hostMicros, and a
+ * test moves it forward.
+ ----------------------------------------------------------------------*/
+
+#ifndef Arduino_h
+#define Arduino_h 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <new>
+
+typedef bool boolean;
+
+#define DEC 10
+#define HEX 16
+
+#define A14 38
+#define A15 39
+#define A16 40
+#define A17 41
+
+#define DMAMEM
+#define FLASHMEM
+#define F_CPU 600000000
+
+inline uint32_t hostMicros = 0;
+
+inline uint32_t micros() { return hostMicros; }
+inline uint32_t millis() { return hostMicros / 1000; }
+inline long random(long howbig) { return howbig > 0 ? rand() % howbig : 0; }
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t b) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--)
+      n += write(*buffer++);
+    return n;
+  }
+  size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+
+  size_t print(const char *s)                { return write(s); }
+  size_t print(char c)                       { return write((uint8_t)c); }
+  size_t print(int n, int base = DEC)        { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(long n, int base = DEC)       { return _format(base == HEX ? "%lx" : "%ld", n); }
+  size_t print(unsigned long n, int base = DEC) { return _format(base == HEX ? "%lx" : "%lu", n); }
+  size_t print(double d, int digits = 2)     { char f[8]; snprintf(f, sizeof(f), "%%.%df", digits); return _format(f, d); }
+
+  size_t println()                           { return write("\r\n"); }
+  template <class T> size_t println(T x)     { return print(x) + println(); }
+  template <class T> size_t println(T x, int b) { return print(x, b) + println(); }
+
+ private:
+  template <class T> size_t _format(const char *format, T x) {
+    char buf[40];
+    snprintf(buf, sizeof(buf), format, x);
+    return write(buf);
+  }
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual int peek() { return -1; }
+};
+
+#endif
@@ -0,0 +1,37 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+// The Audio library's interrupt masking, which mustn't nest (the first
+// AudioInterrupts() turns the interrupt back on): nesting is counted, so
+// a test can check for it.
+
+#ifndef Audio_h_
+#define Audio_h_ 1
+
+#include <Arduino.h>
+#include <SD.h>
+
+inline int hostAudioMasked = 0;         // AudioNoInterrupts() calls not yet undone
+inline int hostAudioNested = 0;         // times it was called while already masked
+
+inline void AudioNoInterrupts() { if (hostAudioMasked++ > 0) hostAudioNested++; }
+inline void AudioInterrupts()   { hostAudioMasked = 0; }
+
+#endif
@@ -0,0 +1,320 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+/*----------------------------------------------------------------------
+ * The Teensy core's file system interface (FS, File and FileImpl), with
+ * the parts Tactile uses, and MemFS, a file system kept in memory that
+ * stands in for the SD card and for the flash tier in the tests.
+ ----------------------------------------------------------------------*/
+
+#ifndef FS_H
+#define FS_H 1
+
+#include <Arduino.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define FILE_READ        0
+#define FILE_WRITE       1
+#define FILE_WRITE_BEGIN 2
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+struct DateTimeFields {
+  uint8_t sec, min, hour, wday, mday, mon, year;
+};
+
+class File;
+
+class FileImpl {
+ public:
+  virtual ~FileImpl() {}
+  virtual size_t   read(void *buf, size_t nbyte) = 0;
+  virtual size_t   write(const void *buf, size_t size) = 0;
+  virtual bool     seek(uint64_t pos, int mode) = 0;
+  virtual uint64_t position() = 0;
+  virtual uint64_t size() = 0;
+  virtual void     close() = 0;
+  virtual bool     isOpen() = 0;
+  virtual const char *name() = 0;
+  virtual bool     isDirectory() = 0;
+  virtual File     openNextFile(uint8_t mode) = 0;
+  virtual void     rewindDirectory() = 0;
+  virtual bool     getModifyTime(DateTimeFields &tm) = 0;
+  virtual bool     setModifyTime(const DateTimeFields &tm) = 0;
+};
+
+class File : public Stream {
+ public:
+  File() {}
+  File(FileImpl *impl) : _impl(impl) {}
+
+  size_t   read(void *buf, size_t nbyte) { return _impl ? _impl->read(buf, nbyte) : 0; }
+  int      read() { uint8_t b; return read(&b, 1) == 1 ? b : -1; }
+  size_t   write(uint8_t b) { return write(&b, 1); }
+  size_t   write(const void *buf, size_t size) { return _impl ? _impl->write(buf, size) : 0; }
+  size_t   write(const uint8_t *buf, size_t size) { return write((const void *)buf, size); }
+  int      available() { return _impl ? (int)(_impl->size() - _impl->position()) : 0; }
+  bool     seek(uint64_t pos, int mode = SeekSet) { return _impl && _impl->seek(pos, mode); }
+  uint64_t position() { return _impl ? _impl->position() : 0; }
+  uint64_t size() { return _impl ? _impl->size() : 0; }
+  void     close() { if (_impl) _impl->close(); _impl.reset(); }
+  bool     isOpen() { return _impl && _impl->isOpen(); }
+  operator bool() { return isOpen(); }
+  const char *name() { return _impl ? _impl->name() : ""; }
+  bool     isDirectory() { return _impl && _impl->isDirectory(); }
+  File     openNextFile(uint8_t mode = 0) { return _impl ? _impl->openNextFile(mode) : File(); }
+  void     rewindDirectory() { if (_impl) _impl->rewindDirectory(); }
+  bool     getModifyTime(DateTimeFields &tm) { return _impl && _impl->getModifyTime(tm); }
+  bool     setModifyTime(const DateTimeFields &tm) { return _impl && _impl->setModifyTime(tm); }
+
+ private:
+  std::shared_ptr<FileImpl> _impl;
+};
+
+class FS {
+ public:
+  virtual ~FS() {}
+  virtual File     open(const char *filename, uint8_t mode = FILE_READ) = 0;
+  virtual bool     exists(const char *filepath) = 0;
+  virtual bool     mkdir(const char *filepath) = 0;
+  virtual bool     rename(const char *oldfilepath, const char *newfilepath) = 0;
+  virtual bool     remove(const char *filepath) = 0;
+  virtual bool     rmdir(const char *filepath) = 0;
+  virtual uint64_t usedSize() = 0;
+  virtual uint64_t totalSize() = 0;
+};
+
+/*----------------------------------------------------------------------
+ * MemFS. Paths are kept whole ("/", "/E1", "/E1/A.WAV"), each with its
+ * node; a directory's files are the paths just below it. Writing a file
+ * stamps it with the time of writeTime, like a real file system would
+ * with its clock, so a copy only has the original's time if it's set.
+ ----------------------------------------------------------------------*/
+
+struct MemNode {
+  bool                 isDir;
+  std::vector<uint8_t> data;
+  bool                 haveTime;
+  DateTimeFields       mtime;
+};
+
+class MemFS : public FS {
+ public:
+  MemFS(uint64_t capacity) : _capacity(capacity) {
+    _nodes["/"] = std::make_shared<MemNode>(MemNode{true, {}, false, {}});
+    writeTime = DateTimeFields{0, 0, 12, 0, 1, 0, 124};
+  }
+
+  DateTimeFields writeTime;             // what a write sets a file's time to
+
+  // For the tests: makes a file, with its contents and time
+  bool addFile(const char *path, const void *data, size_t size, const DateTimeFields &tm) {
+    File f = open(path, FILE_WRITE_BEGIN);
+    if (!f)
+      return false;
+    f.write(data, size);
+    f.setModifyTime(tm);
+    f.close();
+    return true;
+  }
+  std::shared_ptr<MemNode> node(const char *path) {
+    auto i = _nodes.find(_normalize(path));
+    return i == _nodes.end() ? nullptr : i->second;
+  }
+
+  File open(const char *filename, uint8_t mode = FILE_READ) override;
+  bool exists(const char *filepath) override { return node(filepath) != nullptr; }
+  bool mkdir(const char *filepath) override {
+    std::string path = _normalize(filepath);
+    if (_nodes.count(path) || !_isDir(_parent(path)))
+      return false;
+    _nodes[path] = std::make_shared<MemNode>(MemNode{true, {}, false, {}});
+    return true;
+  }
+  bool rename(const char *oldfilepath, const char *newfilepath) override {
+    std::string from = _normalize(oldfilepath), to = _normalize(newfilepath);
+    auto i = _nodes.find(from);
+    if (i == _nodes.end() || i->second->isDir || _nodes.count(to) || !_isDir(_parent(to)))
+      return false;
+    _nodes[to] = i->second;
+    _nodes.erase(from);
+    return true;
+  }
+  bool remove(const char *filepath) override {
+    auto i = _nodes.find(_normalize(filepath));
+    if (i == _nodes.end() || i->second->isDir)
+      return false;
+    _nodes.erase(i);
+    return true;
+  }
+  bool rmdir(const char *filepath) override {
+    std::string path = _normalize(filepath);
+    if (!_isDir(path) || path == "/" || !_children(path).empty())
+      return false;
+    _nodes.erase(path);
+    return true;
+  }
+  uint64_t usedSize() override {
+    uint64_t used = 0;
+    for (auto &n : _nodes)
+      used += n.second->data.size();
+    return used;
+  }
+  uint64_t totalSize() override { return _capacity; }
+
+ protected:
+  uint64_t _capacity;
+
+ private:
+  friend class MemFileImpl;
+
+  std::map<std::string, std::shared_ptr<MemNode>> _nodes;
+
+  static std::string _normalize(const char *path) {
+    std::string p = (path[0] == '/') ? path : std::string("/") + path;
+    while (p.size() > 1 && p.back() == '/')
+      p.pop_back();
+    return p;
+  }
+  static std::string _parent(const std::string &path) {
+    size_t slash = path.rfind('/');
+    return slash == 0 ? "/" : path.substr(0, slash);
+  }
+  bool _isDir(const std::string &path) {
+    auto i = _nodes.find(path);
+    return i != _nodes.end() && i->second->isDir;
+  }
+  std::vector<std::string> _children(const std::string &dir) {
+    std::vector<std::string> paths;
+    for (auto &n : _nodes) {
+      if (n.first != "/" && _parent(n.first) == dir)
+        paths.push_back(n.first);
+    }
+    return paths;
+  }
+};
+
+class MemFileImpl : public FileImpl {
+ public:
+  MemFileImpl(MemFS *fs, const std::string &path, std::shared_ptr<MemNode> node, uint64_t pos)
+    : _fs(fs), _path(path), _node(node), _pos(pos), _open(true), _next(0) {
+    size_t slash = path.rfind('/');
+    _name = path.substr(slash + 1);
+    if (node->isDir)
+      _list = fs->_children(path);
+  }
+
+  size_t read(void *buf, size_t nbyte) override {
+    if (!_open || _node->isDir || _pos >= _node->data.size())
+      return 0;
+    size_t n = std::min((uint64_t)nbyte, _node->data.size() - _pos);
+    memcpy(buf, _node->data.data() + _pos, n);
+    _pos += n;
+    return n;
+  }
+  size_t write(const void *buf, size_t size) override {
+    if (!_open || _node->isDir)
+      return 0;
+    if (_fs->usedSize() + size > _fs->totalSize())
+      return 0;
+    if (_pos + size > _node->data.size())
+      _node->data.resize(_pos + size);
+    memcpy(_node->data.data() + _pos, buf, size);
+    _pos += size;
+    _node->haveTime = true;
+    _node->mtime = _fs->writeTime;
+    return size;
+  }
+  bool seek(uint64_t pos, int mode) override {
+    if (mode == SeekCur)
+      pos += _pos;
+    else if (mode == SeekEnd)
+      pos += _node->data.size();
+    if (pos > _node->data.size())
+      return false;
+    _pos = pos;
+    return true;
+  }
+  uint64_t position() override { return _pos; }
+  uint64_t size() override { return _node->data.size(); }
+  void close() override { _open = false; }
+  bool isOpen() override { return _open; }
+  const char *name() override { return _name.c_str(); }
+  bool isDirectory() override { return _node->isDir; }
+  File openNextFile(uint8_t mode) override {
+    while (_next < _list.size()) {
+      std::string path = _list[_next++];
+      std::shared_ptr<MemNode> node = _fs->node(path.c_str());
+      if (node)                         // (it may have been removed since)
+        return File(new MemFileImpl(_fs, path, node, 0));
+    }
+    return File();
+  }
+  void rewindDirectory() override {
+    _list = _fs->_children(_path);
+    _next = 0;
+  }
+  bool getModifyTime(DateTimeFields &tm) override {
+    if (!_node->haveTime)
+      return false;
+    tm = _node->mtime;
+    return true;
+  }
+  bool setModifyTime(const DateTimeFields &tm) override {
+    _node->haveTime = true;
+    _node->mtime = tm;
+    return true;
+  }
+
+ private:
+  MemFS                   *_fs;
+  std::string              _path;
+  std::string              _name;
+  std::shared_ptr<MemNode> _node;
+  uint64_t                 _pos;
+  bool                     _open;
+  std::vector<std::string> _list;       // a directory's files, when it was opened
+  size_t                   _next;
+};
+
+inline File MemFS::open(const char *filename, uint8_t mode) {
+  std::string path = _normalize(filename);
+  auto i = _nodes.find(path);
+  if (mode == FILE_READ) {
+    if (i == _nodes.end())
+      return File();
+    return File(new MemFileImpl(this, path, i->second, 0));
+  }
+  if (i == _nodes.end()) {
+    if (!_isDir(_parent(path)))
+      return File();
+    i = _nodes.emplace(path, std::make_shared<MemNode>(MemNode{false, {}, false, {}})).first;
+  }
+  if (i->second->isDir)
+    return File();
+  uint64_t pos = (mode == FILE_WRITE) ? i->second->data.size() : 0;
+  return File(new MemFileImpl(this, path, i->second, pos));
+}
+
+#endif
@@ -0,0 +1,47 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+// LittleFS on a PC: there's no flash memory, so the QSPI and program
+// flash file systems never start, but LittleFS_RAM works (as a MemFS).
+
+#ifndef LittleFS_h
+#define LittleFS_h 1
+
+#include <FS.h>
+
+class LittleFS_RAM : public MemFS {
+ public:
+  LittleFS_RAM() : MemFS(0) {}
+  bool begin(uint32_t size) { _capacity = size; return true; }
+};
+
+class LittleFS_Program : public MemFS {
+ public:
+  LittleFS_Program() : MemFS(0) {}
+  bool begin(uint32_t size) { return false; }
+};
+
+class LittleFS_QSPIFlash : public MemFS {
+ public:
+  LittleFS_QSPIFlash() : MemFS(0) {}
+  bool begin() { return false; }
+};
+
+#endif
@@ -0,0 +1,40 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+// The SD card, as a MemFS. A test takes it out with present = false.
+
+#ifndef SD_H
+#define SD_H 1
+
+#include <FS.h>
+
+#define BUILTIN_SDCARD 254
+
+class SDClass : public MemFS {
+ public:
+  SDClass() : MemFS(32*1024*1024) {}
+  bool present = true;
+  bool begin(uint8_t csPin = BUILTIN_SDCARD) { return present; }
+  bool mediaPresent() { return present; }
+};
+
+inline SDClass SD;
+
+#endif
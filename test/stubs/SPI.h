@@ -0,0 +1,34 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+#ifndef _SPI_H_INCLUDED
+#define _SPI_H_INCLUDED 1
+
+#include <Arduino.h>
+
+class SPIClass {
+ public:
+  void setMOSI(uint8_t pin) {}
+  void setSCK(uint8_t pin) {}
+};
+
+inline SPIClass SPI;
+
+#endif
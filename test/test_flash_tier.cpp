@@ -0,0 +1,187 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+/*----------------------------------------------------------------------
+ * Checks TactileFileManager's flash tier, with the SD card and the flash
+ * both in memory (see stubs/FS.h): which file system getFileSystem()
+ * chooses, and the background copy (_copyStep()): only clips played
+ * often enough and small enough, only while nothing is playing, a slice
+ * at a time, an exact copy with the original's time, and stale copies
+ * removed when the system starts again.
+ ----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <vector>
+#include <Audio.h>
+#include <LittleFS.h>
+#include "TactileFileManager.h"
+
+#define BACKGROUND_PASSES  20000        // enough to finish everything there is to do
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { if (!(cond)) { printf("FAIL line %d: %s\n", __LINE__, #cond); failures++; } } while (0)
+
+static const DateTimeFields cardTime = {30, 15, 10, 2, 14, 3, 123};
+
+// A 16-bit stereo .WAV file, with a different sound for each seed
+static std::vector<uint8_t> makeWav(uint32_t frames, int seed) {
+  uint32_t dataBytes = frames * 4;
+  std::vector<uint8_t> wav(44 + dataBytes);
+  uint8_t *p = wav.data();
+  auto le16 = [&](uint16_t v) { *p++ = v & 0xFF; *p++ = v >> 8; };
+  auto le32 = [&](uint32_t v) { le16(v & 0xFFFF); le16(v >> 16); };
+  auto tag = [&](const char *t) { memcpy(p, t, 4); p += 4; };
+  tag("RIFF"); le32(36 + dataBytes); tag("WAVE");
+  tag("fmt "); le32(16); le16(1); le16(2); le32(44100); le32(44100 * 4); le16(4); le16(16);
+  tag("data"); le32(dataBytes);
+  for (uint32_t i = 0; i < frames * 2; i++)
+    le16((uint16_t)((i * 37 + seed * 1000) % 20000));
+  return wav;
+}
+
+static void addWav(const char *path, uint32_t frames, int seed) {
+  std::vector<uint8_t> wav = makeWav(frames, seed);
+  SD.addFile(path, wav.data(), wav.size(), cardTime);
+}
+
+static bool sameFile(MemFS *a, MemFS *b, const char *path) {
+  std::shared_ptr<MemNode> na = a->node(path), nb = b->node(path);
+  if (!na || !nb || na->data != nb->data || na->haveTime != nb->haveTime)
+    return false;
+  return !na->haveTime || memcmp(&na->mtime, &nb->mtime, sizeof(DateTimeFields)) == 0;
+}
+
+static void runBackground(TactileFileManager *fm, bool audioIdle, int passes = BACKGROUND_PASSES) {
+  for (int i = 0; i < passes; i++) {
+    fm->doBackgroundTasks(audioIdle);
+    hostMicros += 100;
+  }
+}
+
+// The file numbers, in the root directory's sorted order
+enum { CLIP_A, CLIP_B, CLIP_BIG };
+
+int main() {
+  TactileCPU *tc = TactileCPU::setup();
+  LittleFS_RAM flash;
+  flash.begin(2*1024*1024);
+
+  addWav("/A.WAV", 4000, 1);                               // 16 KB
+  addWav("/B.WAV", 2000, 2);
+  addWav("/BIG.WAV", FLASH_TIER_MAX_CLIP / 4 + 1000, 3);   // too big for the tier
+  SD.mkdir("/E1");
+  addWav("/E1/C.WAV", 3000, 4);
+
+  TactileFileManager *fm = new TactileFileManager(tc);
+  int e1 = fm->findDirectory("/E1");
+  CHECK(e1 > ROOT_DIR);
+  CHECK(fm->getNumFiles(ROOT_DIR) == 3);
+  CHECK(strcmp(fm->getFileName(CLIP_BIG), "BIG.WAV") == 0);
+
+  // No tier: everything is on the card
+  for (int i = 0; i < 3; i++)
+    CHECK(fm->getFileSystem(i) == &SD);
+  CHECK(fm->setFlashTier(&flash));
+  runBackground(fm, true);
+  for (int i = 0; i < 3; i++)
+    CHECK(fm->getFileSystem(i) == &SD);
+  CHECK(flash.usedSize() == 0);
+
+  // Played once isn't enough
+  fm->notePlayed(CLIP_A);
+  runBackground(fm, true);
+  CHECK(fm->getFileSystem(CLIP_A) == &SD);
+  CHECK(!flash.exists("/A.WAV"));
+
+  // Played twice it is, but nothing's copied while the audio is busy
+  fm->notePlayed(CLIP_A);
+  runBackground(fm, false);
+  CHECK(fm->getFileSystem(CLIP_A) == &SD);
+  CHECK(!flash.exists("/A.WAV"));
+
+  // It's copied a slice at a time, and played from the card until it's done
+  uint32_t size = SD.node("/A.WAV")->data.size();
+  int steps = 0;
+  while (fm->getFileSystem(CLIP_A) == &SD && steps < BACKGROUND_PASSES) {
+    fm->doBackgroundTasks(true);
+    steps++;
+  }
+  CHECK(fm->getFileSystem(CLIP_A) == &flash);
+  CHECK(steps >= (int)(size / FLASH_COPY_CHUNK));
+  CHECK(sameFile(&SD, &flash, "/A.WAV"));
+  CHECK(fm->getFileSystem(CLIP_B) == &SD);
+
+  // Too big for the tier, however often it's played
+  fm->notePlayed(CLIP_BIG);
+  fm->notePlayed(CLIP_BIG);
+  fm->notePlayed(CLIP_BIG);
+  runBackground(fm, true);
+  CHECK(fm->getFileSystem(CLIP_BIG) == &SD);
+  CHECK(!flash.exists("/BIG.WAV"));
+
+  // A directory other than the root, which has to be made in the flash
+  fm->notePlayed(e1, 0);
+  fm->notePlayed(e1, 0);
+  runBackground(fm, true);
+  CHECK(fm->getFileSystem(e1, 0) == &flash);
+  CHECK(sameFile(&SD, &flash, "/E1/C.WAV"));
+
+  // B too, then start again with A changed on the card: the copy of A
+  // is stale and removed, B's is still good
+  fm->notePlayed(CLIP_B);
+  fm->notePlayed(CLIP_B);
+  runBackground(fm, true);
+  CHECK(fm->getFileSystem(CLIP_B) == &flash);
+  delete fm;
+  SD.remove("/A.WAV");
+  addWav("/A.WAV", 4100, 5);
+
+  fm = new TactileFileManager(tc);
+  e1 = fm->findDirectory("/E1");
+  CHECK(fm->setFlashTier(&flash));
+  CHECK(fm->getFileSystem(CLIP_A) == &SD);
+  CHECK(!flash.exists("/A.WAV"));
+  CHECK(fm->getFileSystem(CLIP_B) == &flash);
+  CHECK(fm->getFileSystem(e1, 0) == &flash);
+
+  // A flash tier that's full: the clip stays on the card
+  delete fm;
+  LittleFS_RAM small;
+  small.begin(8*1024);
+  fm = new TactileFileManager(tc);
+  CHECK(fm->setFlashTier(&small));
+  fm->notePlayed(CLIP_A);
+  fm->notePlayed(CLIP_A);
+  runBackground(fm, true);
+  CHECK(fm->getFileSystem(CLIP_A) == &SD);
+  CHECK(small.usedSize() == 0);
+
+  // The audio interrupt was never masked twice over
+  CHECK(hostAudioNested == 0);
+  delete fm;
+
+  if (failures == 0)
+    printf("ok   flash tier\n");
+  else
+    printf("%s", hostLog.c_str());
+  return failures ? 1 : 0;
+}
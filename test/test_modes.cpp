@@ -0,0 +1,328 @@
+/* -*-C-*-
++======================================================================
+| Copyright (c) 2022, Craig A. James
+|
+| This file is part of of the "Tactile" library.
+|
+| Tactile is free software: you can redistribute it and/or modify it under
+| the terms of the GNU Lesser General Public License (LGPL) as published by
+| the Free Software Foundation, either version 3 of the License, or (at
+| your option) any later version.
+|
+| Tactile is distributed in the hope that it will be useful, but WITHOUT
+| ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+| FITNESS FOR A PARTICULAR PURPOSE. See the LGPL for more details.
+|
+| You should have received a copy of the LGPL along with Tactile. If not,
+| see <https://www.gnu.org/licenses/>.
++======================================================================
+*/
+
+/*----------------------------------------------------------------------
+ * Checks Tactile's loop for each combination of interaction modes (see
+ * TactileModes.h) against ReferenceLoop, which is the loop as it was
+ * before it was specialized: one version for all modes, testing the
+ * mode settings as it goes. Each mode combination is run from the same
+ * random sensor input three ways, loop<Modes>(), loop() and the
+ * reference, and what they do (tracks started, stopped, paused, volume,
+ * the LED, ...) has to be the same.
+ ----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string>
+#include "Tactile.h"
+
+#define RUNS_PER_COMBINATION  100
+#define PASSES_PER_RUN        4000
+
+// The loop before TactileModes, using the same sensors and audio (the
+// mocks), with the modes as run-time settings.
+
+class ReferenceLoop {
+ public:
+  ReferenceLoop(bool multiTrack, bool continueTrack, bool proximityAsVolume, int inactivitySeconds) {
+    _tc = TactileCPU::setup();
+    _ts = TactileSensors::setup(_tc);
+    _ta = TactileAudio::setup(_tc);
+    _multiTrack = multiTrack;
+    _continueTrack = continueTrack;
+    _useProximityAsVolume = proximityAsVolume;
+    _restartTimeout = inactivitySeconds * 1000;
+    for (int s = 0; s < NUM_SENSORS; s++) {
+      _touchThreshold[s] = 95;
+      _releaseThreshold[s] = 65;
+    }
+    _ledCycle = 0;
+    _trackCurrentlyPlaying = -1;
+    _nextSensorTick = micros();
+    _nextAudioTick = _nextSensorTick;
+    if (_restartTimeout > 0)
+      _noteActivity();
+  }
+
+  void loop() {
+    uint32_t now = micros();
+    _ta->updateTrackStatus();
+    if (_tickDue(&_nextSensorTick, SENSOR_TICK_MICROS, now)) {
+      if (_useProximityAsVolume)
+        _proximityLoop();
+      else
+        _touchLoop();
+    }
+    bool busy = _ta->doIOTasks();
+    if (_tickDue(&_nextAudioTick, AUDIO_TICK_MICROS, now))
+      _ta->doTimerTasks();
+    if (_timers.due(millis()) == TIMER_INACTIVITY) {
+      if (_ta->cancelAll())
+        _tc->logAction("Inactivity timeout: ", _restartTimeout);
+    }
+    if (!busy)
+      _tc->waitForInterrupt();
+  }
+
+ private:
+  TactileCPU     *_tc;
+  TactileSensors *_ts;
+  TactileAudio   *_ta;
+  TactileTimers   _timers;
+  bool     _multiTrack;
+  bool     _continueTrack;
+  bool     _useProximityAsVolume;
+  uint32_t _restartTimeout;
+  float    _touchThreshold[NUM_SENSORS];
+  float    _releaseThreshold[NUM_SENSORS];
+  int      _ledCycle;
+  int      _trackCurrentlyPlaying;
+  uint32_t _nextSensorTick;
+  uint32_t _nextAudioTick;
+
+  static bool _tickDue(uint32_t *next, uint32_t period, uint32_t now) {
+    if ((int32_t)(now - *next) < 0)
+      return false;
+    *next += period;
+    if ((int32_t)(now - *next) >= 0)
+      *next = now + period;
+    return true;
+  }
+
+  void _noteActivity() {
+    if (_restartTimeout > 0)
+      _timers.set(TIMER_INACTIVITY, millis() + _restartTimeout);
+  }
+
+  void _touchLoop() {
+    int sensorStatus[NUM_SENSORS];
+    int sensorChanged[NUM_SENSORS];
+    int numChanged = _ts->getTouchStatus(sensorStatus, sensorChanged);
+
+    int numTouched = 0;
+    for (int s = FIRST_SENSOR; s <= LAST_SENSOR; s++) {
+      if (sensorStatus[s] == IS_TOUCHED)
+        numTouched++;
+    }
+    if (numTouched > 0 || numChanged > 0)
+      _noteActivity();
+    if (numTouched > 0)
+      _tc->turnLedOn();
+    else
+      _tc->turnLedOff();
+    if (numChanged == 0)
+      return;
+
+    const TactileTrackStatus *status = _ta->getTrackStatus();
+    if (_multiTrack) {
+      for (int s = FIRST_SENSOR; s <= LAST_SENSOR; s++) {
+        int isPlaying = status[s].playing;
+        if (sensorChanged[s] == NEW_TOUCH) {
+          if (!isPlaying) {
+            if (!_continueTrack)
+              _ta->cancelFades(s);
+            _ta->startTrack(s);
+            _tc->logAction("start track ", s+1);
+          } else if (status[s].paused) {
+            _ta->resumeTrack(s);
+            _tc->logAction("resume track ", s+1);
+          } else {
+            _ta->startTrack(s);
+            _tc->logAction("restart track (was paused?) ", s+1);
+          }
+        } else if (sensorChanged[s] == NEW_RELEASE && isPlaying) {
+          if (_continueTrack) {
+            _ta->pauseTrack(s);
+            _tc->logAction("pause track ", s+1);
+          } else {
+            _ta->stopTrack(s);
+            _tc->logAction("stop track ", s+1);
+          }
+        }
+      }
+      return;
+    }
+
+    if (_trackCurrentlyPlaying >= 0 && sensorStatus[_trackCurrentlyPlaying] == IS_TOUCHED)
+      return;
+    if (_trackCurrentlyPlaying >= 0 && sensorChanged[_trackCurrentlyPlaying] == NEW_RELEASE) {
+      if (_continueTrack) {
+        _ta->pauseTrack(_trackCurrentlyPlaying);
+        _tc->logAction("pause track ", _trackCurrentlyPlaying+1);
+      } else {
+        _ta->stopTrack(_trackCurrentlyPlaying);
+        _tc->logAction("stop track ", _trackCurrentlyPlaying+1);
+      }
+    }
+    _trackCurrentlyPlaying = -1;
+    for (int s = FIRST_SENSOR; s <= LAST_SENSOR; s++) {
+      if (sensorStatus[s] == IS_TOUCHED) {
+        if (status[s].paused) {
+          _ta->resumeTrack(s);
+          _tc->logAction("resume track ", s+1);
+        } else {
+          if (!_continueTrack)
+            _ta->cancelFades(s);
+          _ta->startTrack(s);
+          _tc->logAction("start track ", s+1);
+        }
+        _trackCurrentlyPlaying = s;
+        break;
+      }
+    }
+  }
+
+  void _proximityLoop() {
+    float sensorValues[NUM_SENSORS];
+    float maxSensorValue = 0.0;
+    int   maxSensorNumber = -1;
+    for (int s = FIRST_SENSOR; s <= LAST_SENSOR; s++) {
+      sensorValues[s] = _ts->getProximityPercent(s);
+      if (sensorValues[s] > maxSensorValue) {
+        maxSensorValue = sensorValues[s];
+        maxSensorNumber = s;
+      }
+    }
+    if (_ledCycle < int(maxSensorValue))
+      _tc->turnLedOn();
+    else
+      _tc->turnLedOff();
+    if (++_ledCycle > 99)
+      _ledCycle = 0;
+
+    const TactileTrackStatus *status = _ta->getTrackStatus();
+    for (int s = FIRST_SENSOR; s <= LAST_SENSOR; s++) {
+      if (!_multiTrack && s != maxSensorNumber)
+        continue;
+      int playing = status[s].playing && !status[s].paused;
+      if (sensorValues[s] > _touchThreshold[s]) {
+        if (!playing) {
+          if (status[s].paused) {
+            _ta->resumeTrack(s);
+            _tc->logAction("resume ", s+1);
+          } else {
+            _ta->startTrack(s);
+            _tc->logAction("play ", s+1);
+          }
+        }
+        _ta->setVolume(s, sensorValues[s]);
+        _noteActivity();
+      } else if (sensorValues[s] < _releaseThreshold[s] && playing) {
+        if (_continueTrack) {
+          _ta->pauseTrack(s);
+          _tc->logAction("pause ", s+1);
+        } else {
+          _ta->stopTrack(s);
+          _tc->logAction("stop ", s+1);
+        }
+        _ta->setVolume(s, 0);
+        _noteActivity();
+      }
+    }
+  }
+};
+
+// How the sensors change: a touch or release every so often, and the
+// proximity moving around the thresholds, so every branch is taken.
+
+static uint32_t inputState;
+
+static uint32_t nextInput() {
+  inputState ^= inputState << 13;
+  inputState ^= inputState >> 17;
+  inputState ^= inputState << 5;
+  return inputState;
+}
+
+enum { RUN_SPECIALIZED, RUN_RUNTIME, RUN_REFERENCE };
+
+template <class Modes>
+static std::string run(int how, uint32_t seed, int inactivitySeconds) {
+  hostMicros = 1000000;
+  hostTrace.clear();
+  hostRandomState = seed;
+  inputState = seed * 2654435761u;
+  for (int s = 0; s < NUM_SENSORS; s++) {
+    hostTouched[s] = false;
+    hostProximity[s] = 0.0;
+  }
+
+  Tactile *t = NULL;
+  ReferenceLoop *ref = NULL;
+  if (how == RUN_REFERENCE)
+    ref = new ReferenceLoop(Modes::multiTrack, Modes::continueTrack, Modes::proximityAsVolume,
+                            inactivitySeconds);
+  else {
+    t = Tactile::setup();
+    t->setModes<Modes>();
+    t->setInactivityTimeout(inactivitySeconds);
+  }
+  hostTrace.clear();                    // (setup's own messages aren't part of the comparison)
+
+  for (int pass = 0; pass < PASSES_PER_RUN; pass++) {
+    for (int s = 0; s < NUM_SENSORS; s++) {
+      if (nextInput() % 50 == 0)
+        hostTouched[s] = !hostTouched[s];
+      if (nextInput() % 8 == 0)
+        hostProximity[s] = (float)(nextInput() % 101);
+    }
+    if (how == RUN_SPECIALIZED)
+      t->loop<Modes>();
+    else if (how == RUN_RUNTIME)
+      t->loop();
+    else
+      ref->loop();
+    hostMicros += 200 + nextInput() % 1600;
+  }
+  delete ref;
+  return hostTrace;
+}
+
+static int failures = 0;
+
+template <class Modes>
+static void check(const char *name) {
+  int actions = 0;
+  for (uint32_t seed = 1; seed <= RUNS_PER_COMBINATION; seed++) {
+    int inactivitySeconds = seed % 3;
+    std::string expected = run<Modes>(RUN_REFERENCE, seed, inactivitySeconds);
+    std::string specialized = run<Modes>(RUN_SPECIALIZED, seed, inactivitySeconds);
+    std::string runtime = run<Modes>(RUN_RUNTIME, seed, inactivitySeconds);
+    actions += (int)expected.size();
+    if (specialized != expected || runtime != expected) {
+      printf("FAIL %s, run %u: %s differs from the reference\n", name, (unsigned)seed,
+             specialized != expected ? "loop<Modes>()" : "loop()");
+      failures++;
+      return;
+    }
+  }
+  printf("ok   %s (%d bytes of actions)\n", name, actions);
+}
+
+int main() {
+  check<TactileModes<false, false, false, false>>("single-track");
+  check<TactileModes<true,  false, false, false>>("multi-track");
+  check<TactileModes<false, true,  false, false>>("single-track, continue");
+  check<TactileModes<true,  true,  false, false>>("multi-track, continue");
+  check<TactileModes<false, false, false, true >>("single-track, proximity");
+  check<TactileModes<true,  false, false, true >>("multi-track, proximity");
+  check<TactileModes<false, true,  false, true >>("single-track, continue, proximity");
+  check<TactileModes<true,  true,  false, true >>("multi-track, continue, proximity");
+  return failures ? 1 : 0;
+}